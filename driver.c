@@ -17,171 +17,685 @@
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h> /* invalidate_bdev */
 #include <linux/bio.h>
+#include <linux/highmem.h>
+#include <linux/radix-tree.h>
+#include <linux/idr.h>
+#include <linux/mutex.h>
+#include <linux/device.h>
+#include <linux/nodemask.h>
+#include "msfs.h"
 
 MODULE_LICENSE("Vkang BSD/GPL");
 
-extern int setup_msfs_filesystem(char *p, int size);
+extern int setup_msfs_filesystem(void *dev, unsigned long nr_blocks,
+                                 int (*write_block)(void *dev, unsigned long nr, const char *data));
 static int major = 0;
 
 static int sect_size = 512;
 
-static int nsectors = 1024*2*2;
-static char buf_dev[1024*1024*2] = { 0 };
+/*
+* Device size in MB. Memory is only taken for the pages actually written,
+* so a large device costs nothing until it is filled.
+*/
+static unsigned long size = 2;
+module_param(size, ulong, S_IRUGO);
+MODULE_PARM_DESC(size, "Device size in MB (default 2)");
+
+/*
+* Number of devices created at load, more are added and removed through
+* /sys/class/msfsblk/add and remove.
+*/
+static int nr_devs = 1;
+module_param(nr_devs, int, S_IRUGO);
+MODULE_PARM_DESC(nr_devs, "Number of devices to create at load (default 1)");
+
+/*
+* Backing memory comes in chunks of 1 << chunk_order pages, 9 gives 2 MB
+* chunks on x86: one tree lookup and one physically contiguous block per
+* 2 MB instead of per page, but the first write to a chunk takes all of it.
+* Chunks go to numa_node, or round robin over the online nodes with
+* interleave, see /sys/block/msfsblkN/node_usage.
+*/
+static int chunk_order = 0;
+module_param(chunk_order, int, S_IRUGO);
+MODULE_PARM_DESC(chunk_order, "Allocate backing memory in chunks of 2^chunk_order pages (default 0)");
+
+static int numa_node = NUMA_NO_NODE;
+module_param(numa_node, int, S_IRUGO);
+MODULE_PARM_DESC(numa_node, "Node for the backing memory, -1 for the node of the writer (default)");
+
+static bool interleave = false;
+module_param(interleave, bool, S_IRUGO);
+MODULE_PARM_DESC(interleave, "Spread the backing chunks over all online nodes");
+
+#define PAGE_SECTORS_SHIFT (PAGE_SHIFT - 9)
+#define PAGE_SECTORS (1 << PAGE_SECTORS_SHIFT)
+#define CHUNK_SECTORS_SHIFT (PAGE_SECTORS_SHIFT + chunk_order)
+#define CHUNK_SECTORS (1 << CHUNK_SECTORS_SHIFT)
+#define CHUNK_SIZE (PAGE_SIZE << chunk_order)
+
+/*
+* How the device takes its I/O: through a request queue and the elevator,
+* or bio by bio straight from make_request with no queueing at all.
+*/
+enum {
+    BLK_MODE_BIO = 0,
+    BLK_MODE_RQ = 1,
+};
+static int queue_mode = BLK_MODE_RQ;
+module_param(queue_mode, int, S_IRUGO);
+MODULE_PARM_DESC(queue_mode, "0: bio based (make_request), 1: request queue (default)");
 
 /*
 * The internal representation of our device.
 */
 struct blk_dev{
-         int size;                        /* Device size in sectors */
-         u8 *data;                        /* The data array */
+         int id;                          /* The N of msfsblkN, also its minor */
+         sector_t size;                   /* Device size in sectors */
+         spinlock_t lock;                 /* Protects inserts into pages, users */
+         int users;                       /* Opens of the disk */
+         int dying;                       /* Being removed, no new opens */
+         struct radix_tree_root pages;    /* Backing chunks by chunk index */
+         atomic_long_t *node_chunks;      /* Chunks held on each node */
          struct request_queue *queue;     /* The device request queue */
          struct gendisk *gd;              /* The gendisk structure */
-         struct page *p;
+         struct list_head list;           /* On blk_devices */
 };
 
-struct blk_dev *dev;
+static LIST_HEAD(blk_devices);
+static DEFINE_MUTEX(blk_devices_mutex); //the list, add and remove
+static DEFINE_IDA(blk_ida);
 
 
 /*
-* Handle an I/O request, in sectors.
+* The backing store, brd style: a chunk of 1 << chunk_order pages is only
+* allocated the first time something is written to it, a sector without a
+* chunk reads back as zeros. Lookups run under rcu, a discarded chunk is
+* freed after a grace period.
 */
-static void blk_transfer(struct blk_dev *dev, unsigned long sector,
-   unsigned long nsect, char *buffer, int write)
+static int blk_chunk_node(pgoff_t idx)
 {
-    unsigned long offset = sector * sect_size;
-    unsigned long nbytes = nsect * sect_size;
+    int node, n;
 
-    if ((offset + nbytes) > dev->size) {
-       printk (KERN_NOTICE "Beyond-end write (%ld %ld)\n", offset, nbytes);
-       return;
+    if (!interleave)
+        return numa_node;
+    n = idx % num_online_nodes();
+    for_each_online_node(node) {
+        if (n-- == 0)
+            return node;
     }
-    if (write)
-       memcpy(dev->data + offset, buffer, nbytes);
-    else
-       memcpy(buffer, dev->data + offset, nbytes);
+    return NUMA_NO_NODE;
+}
+
+static struct page *blk_lookup_chunk(struct blk_dev *dev, sector_t sector)
+{
+    struct page *chunk;
+
+    rcu_read_lock();
+    chunk = radix_tree_lookup(&dev->pages, sector >> CHUNK_SECTORS_SHIFT);
+    rcu_read_unlock();
+    return chunk;
+}
+
+static struct page *blk_insert_chunk(struct blk_dev *dev, sector_t sector)
+{
+    pgoff_t idx = sector >> CHUNK_SECTORS_SHIFT;
+    struct page *chunk;
+
+    chunk = blk_lookup_chunk(dev, sector);
+    if (chunk)
+        return chunk;
+
+    chunk = alloc_pages_node(blk_chunk_node(idx), GFP_NOIO | __GFP_HIGHMEM | __GFP_ZERO,
+                             chunk_order);
+    if (!chunk)
+        return NULL;
+    if (radix_tree_preload(GFP_NOIO)) {
+        __free_pages(chunk, chunk_order);
+        return NULL;
+    }
+
+    spin_lock(&dev->lock);
+    chunk->index = idx;
+    if (radix_tree_insert(&dev->pages, idx, chunk)) {
+        //somebody else got there first
+        __free_pages(chunk, chunk_order);
+        chunk = radix_tree_lookup(&dev->pages, idx);
+    } else {
+        atomic_long_inc(&dev->node_chunks[page_to_nid(chunk)]);
+    }
+    spin_unlock(&dev->lock);
+    radix_tree_preload_end();
+    return chunk;
+}
+
+static void blk_free_chunk_rcu(struct rcu_head *head)
+{
+    __free_pages(container_of(head, struct page, rcu_head), chunk_order);
+}
+
+//the page of chunk holding sector, *offset is where sector starts in it
+static struct page *blk_chunk_page(struct page *chunk, sector_t sector, unsigned int *offset)
+{
+    unsigned int off = (sector & (CHUNK_SECTORS - 1)) << 9;
+
+    *offset = off & ~PAGE_MASK;
+    return nth_page(chunk, off >> PAGE_SHIFT);
+}
+
+/*
+* Drop the backing store of nbytes at sector. Whole chunks are given back,
+* readers may still be copying them under rcu so they are freed after a
+* grace period; the partial chunks at the ends are only zeroed.
+*/
+static void blk_discard(struct blk_dev *dev, sector_t sector, unsigned int nbytes)
+{
+    unsigned int offset, len;
+    struct page *chunk;
+    char *mem;
+
+    while (nbytes) {
+        if (!(sector & (CHUNK_SECTORS - 1)) && nbytes >= CHUNK_SIZE) {
+            spin_lock(&dev->lock);
+            chunk = radix_tree_delete(&dev->pages, sector >> CHUNK_SECTORS_SHIFT);
+            if (chunk)
+                atomic_long_dec(&dev->node_chunks[page_to_nid(chunk)]);
+            spin_unlock(&dev->lock);
+            if (chunk)
+                call_rcu(&chunk->rcu_head, blk_free_chunk_rcu);
+            len = CHUNK_SIZE;
+        } else {
+            offset = (sector & (PAGE_SECTORS - 1)) << 9;
+            len = min_t(unsigned int, nbytes, PAGE_SIZE - offset);
+            rcu_read_lock();
+            chunk = radix_tree_lookup(&dev->pages, sector >> CHUNK_SECTORS_SHIFT);
+            if (chunk) {
+                mem = kmap_atomic(blk_chunk_page(chunk, sector, &offset));
+                memset(mem + offset, 0, len);
+                kunmap_atomic(mem);
+            }
+            rcu_read_unlock();
+        }
+        sector += len >> 9;
+        nbytes -= len;
+    }
+}
+
+static void blk_free_pages(struct blk_dev *dev)
+{
+    struct page *chunks[16];
+    unsigned long pos = 0;
+    int i, n;
+
+    do {
+        n = radix_tree_gang_lookup(&dev->pages, (void **)chunks, pos, ARRAY_SIZE(chunks));
+        for (i = 0; i < n; i++) {
+            pos = chunks[i]->index;
+            radix_tree_delete(&dev->pages, pos);
+            atomic_long_dec(&dev->node_chunks[page_to_nid(chunks[i])]);
+            __free_pages(chunks[i], chunk_order);
+        }
+        pos++;
+    } while (n == ARRAY_SIZE(chunks));
+}
+
+/*
+* Allocate the chunks a write of nbytes at sector lands in, before the
+* caller maps anything atomically. nbytes is at most a page, so at most
+* two chunks.
+*/
+static int blk_setup_write(struct blk_dev *dev, sector_t sector, unsigned int nbytes)
+{
+    unsigned int offset = (sector & (CHUNK_SECTORS - 1)) << 9;
+
+    if (!blk_insert_chunk(dev, sector))
+        return -ENOMEM;
+    if (offset + nbytes > CHUNK_SIZE &&
+        !blk_insert_chunk(dev, sector + ((CHUNK_SIZE - offset) >> 9)))
+        return -ENOMEM;
+    return 0;
+}
+
+/*
+* Handle an I/O request, in bytes, it may straddle two backing pages.
+*/
+static void blk_transfer(struct blk_dev *dev, sector_t sector,
+   unsigned int nbytes, char *buffer, int write)
+{
+    unsigned int offset, len;
+    struct page *chunk;
+    char *mem;
+
+    while (nbytes) {
+        offset = (sector & (PAGE_SECTORS - 1)) << 9;
+        len = min_t(unsigned int, nbytes, PAGE_SIZE - offset);
+        rcu_read_lock();
+        chunk = radix_tree_lookup(&dev->pages, sector >> CHUNK_SECTORS_SHIFT);
+        if (chunk) {
+            mem = kmap_atomic(blk_chunk_page(chunk, sector, &offset));
+            if (write)
+               memcpy(mem + offset, buffer, len);
+            else
+               memcpy(buffer, mem + offset, len);
+            kunmap_atomic(mem);
+        } else if (!write) {
+            memset(buffer, 0, len);
+        }
+        rcu_read_unlock();
+        buffer += len;
+        sector += len >> 9;
+        nbytes -= len;
+    }
+}
+
+/*
+* Copy one segment straight from or to its page.
+*/
+static int blk_transfer_bvec(struct blk_dev *dev, sector_t sector,
+   struct bio_vec *bvec, int write)
+{
+    char *buffer;
+
+    if (write && blk_setup_write(dev, sector, bvec->bv_len))
+        return -ENOMEM;
+    buffer = kmap_atomic(bvec->bv_page);
+    blk_transfer(dev, sector, bvec->bv_len, buffer + bvec->bv_offset, write);
+    kunmap_atomic(buffer);
+    return 0;
+}
+
+/*
+* Copy a whole request, segment by segment.
+*/
+static int blk_xfer_request(struct blk_dev *dev, struct request *req)
+{
+    struct req_iterator iter;
+    struct bio_vec *bvec;
+    sector_t sector = blk_rq_pos(req);
+    int err;
+
+    if (req->cmd_type != REQ_TYPE_FS)
+        return -EIO;
+    if (sector + blk_rq_sectors(req) > dev->size) {
+       printk (KERN_NOTICE "Beyond-end request (%llu %u)\n",
+               (unsigned long long)sector, blk_rq_sectors(req));
+       return -EIO;
+    }
+    if (req->cmd_flags & REQ_DISCARD) {
+        blk_discard(dev, sector, blk_rq_bytes(req));
+        return 0;
+    }
+
+    rq_for_each_segment(bvec, req, iter) {
+        err = blk_transfer_bvec(dev, sector, bvec, rq_data_dir(req));
+        if (err)
+            return err;
+        sector += bvec->bv_len / sect_size;
+    }
+    return 0;
 }
 
 /*
 * The simple form of the request function.
+*
+* It is entered with the queue lock held, but the copy does not need it:
+* chunks are looked up in dev->pages under rcu, a write to a missing chunk
+* allocates one with GFP_NOIO and inserts it under dev->lock. So the queue
+* lock is dropped around the copy, which also lets the allocation sleep,
+* and other cpus can queue, fetch and copy their own requests meanwhile.
 */
 static void blk_request(struct request_queue *q)
 {
     struct request *req;
+    int err;
 
     req = blk_fetch_request(q);
     while (req != NULL)
     {
        struct blk_dev *dev = req->rq_disk->private_data;
 
-       blk_transfer(dev, blk_rq_pos(req), blk_rq_cur_sectors(req), req->buffer, rq_data_dir(req));
+       spin_unlock_irq(q->queue_lock);
+       err = blk_xfer_request(dev, req);
+       spin_lock_irq(q->queue_lock);
 
-       if(!__blk_end_request_cur(req, 0))
-       {
-            req = blk_fetch_request(q);
-       }
+       __blk_end_request_all(req, err);
+       req = blk_fetch_request(q);
     }
 }
 
 /*
-* The device operations structure.
+* The bio based form, used with queue_mode=0. Each bio is copied and ended
+* right here, nothing is queued, merged or sorted.
 */
+static void blk_make_request(struct request_queue *q, struct bio *bio)
+{
+    struct blk_dev *dev = q->queuedata;
+    sector_t sector = bio->bi_sector;
+    struct bio_vec *bvec;
+    int i, err = 0;
+
+    if (sector + bio_sectors(bio) > dev->size) {
+       printk (KERN_NOTICE "Beyond-end bio (%llu %u)\n",
+               (unsigned long long)sector, bio_sectors(bio));
+       err = -EIO;
+       goto out;
+    }
+    if (bio->bi_rw & REQ_DISCARD) {
+        blk_discard(dev, sector, bio->bi_size);
+        goto out;
+    }
+
+    bio_for_each_segment(bvec, bio, i) {
+        err = blk_transfer_bvec(dev, sector, bvec, bio_data_dir(bio));
+        if (err)
+            break;
+        sector += bvec->bv_len / sect_size;
+    }
+out:
+    bio_endio(bio, err);
+}
+
+/*
+* The device operations structure. Openers are counted so a device in use
+* cannot be removed under them.
+*/
+static int blk_open(struct block_device *bdev, fmode_t mode)
+{
+    struct blk_dev *dev = bdev->bd_disk->private_data;
+    int err = 0;
+
+    spin_lock(&dev->lock);
+    if (dev->dying)
+        err = -ENXIO;
+    else
+        dev->users++;
+    spin_unlock(&dev->lock);
+    return err;
+}
+
+static void blk_release(struct gendisk *disk, fmode_t mode)
+{
+    struct blk_dev *dev = disk->private_data;
+
+    spin_lock(&dev->lock);
+    dev->users--;
+    spin_unlock(&dev->lock);
+}
+
 static struct block_device_operations blk_ops = {
 .owner            = THIS_MODULE,
+.open             = blk_open,
+.release          = blk_release,
 };
 
-static int __init blk_init(void)
+//where the backing memory of the device is, per node
+static ssize_t blk_node_usage_show(struct device *d, struct device_attribute *attr,
+   char *buf)
 {
-    int err = 0;
-    //注册设备块驱动程序
-    major = register_blkdev(0, "blk");
-    if (major <= 0) {
-       printk(KERN_WARNING "blk: unable to get major number\n");
-       return -EBUSY;
+    struct blk_dev *dev = dev_to_disk(d)->private_data;
+    ssize_t n = 0;
+    int node;
+
+    for_each_online_node(node)
+        n += scnprintf(buf + n, PAGE_SIZE - n, "node%d %lu kB\n", node,
+                       atomic_long_read(&dev->node_chunks[node]) <<
+                       (PAGE_SHIFT - 10 + chunk_order));
+    return n;
+}
+
+static DEVICE_ATTR(node_usage, S_IRUGO, blk_node_usage_show, NULL);
+
+//mkfs writes through this, the MBR and every other unwritten block stay zero
+static int blk_write_block(void *data, unsigned long nr, const char *buf)
+{
+    struct blk_dev *dev = data;
+    sector_t sector = (sector_t)nr * (MSFS_BLOCK_SIZE / sect_size);
+
+    if (blk_setup_write(dev, sector, MSFS_BLOCK_SIZE))
+        return -ENOMEM;
+    blk_transfer(dev, sector, MSFS_BLOCK_SIZE, (char *)buf, 1);
+    return 0;
+}
+
+/*
+* Create msfsblk<id> of mb MB with a fresh filesystem on it. Called with
+* blk_devices_mutex held, which also serializes the mkfs buffer in tool.c.
+*/
+static int blk_add(unsigned long mb)
+{
+    struct blk_dev *dev;
+    int err;
+
+    //the filesystem counts 1k blocks in an int
+    if (mb == 0 || mb > (INT_MAX >> 10)) {
+       printk(KERN_WARNING "blk: bad size %lu MB\n", mb);
+       return -EINVAL;
     }
-    dev = kmalloc(sizeof(struct blk_dev), GFP_KERNEL);
+
+    dev = kzalloc(sizeof(struct blk_dev), GFP_KERNEL);
     if (dev == NULL)
-    {
+       return -ENOMEM;
+    dev->node_chunks = kcalloc(nr_node_ids, sizeof(atomic_long_t), GFP_KERNEL);
+    if (dev->node_chunks == NULL) {
        err = -ENOMEM;
-       goto out_unregister;
+       goto out_free5;
     }
 
-#if 0
-    dev->p = alloc_pages(GFP_KERNEL, 8);
-
-    if (dev->p == NULL)
-    {
-        printk("alloc_pages failure\n");
+    dev->id = ida_simple_get(&blk_ida, 0, 1 << MINORBITS, GFP_KERNEL);
+    if (dev->id < 0) {
+        err = dev->id;
         goto out_free4;
     }
-    free_pages((unsigned long)page_address(dev->p), 8);
-#endif
-    /*
-    * Get some memory.
-    */
-    dev->size = nsectors * sect_size;
-    //dev->data = kzalloc(dev->size, GFP_KERNEL);
-    //if (dev->data == NULL) {
-       //printk (KERN_NOTICE "kzalloc failure.\n");
-       //goto out_free4;
-    //}
-
-    dev->data = buf_dev;
-
+    dev->size = (sector_t)mb << (20 - 9);
+    spin_lock_init(&dev->lock);
+    INIT_RADIX_TREE(&dev->pages, GFP_ATOMIC);
 
     //初始化请求队列
-    dev->queue = blk_init_queue(blk_request, NULL);
-    if (dev->queue == NULL)
+    if (queue_mode == BLK_MODE_BIO) {
+        dev->queue = blk_alloc_queue_node(GFP_KERNEL, numa_node);
+        if (dev->queue)
+            blk_queue_make_request(dev->queue, blk_make_request);
+    } else {
+        dev->queue = blk_init_queue_node(blk_request, NULL, numa_node);
+    }
+    if (dev->queue == NULL) {
+        err = -ENOMEM;
         goto out_free3;
+    }
 
     //指明扇区的大小
     blk_queue_logical_block_size(dev->queue, sect_size);
     dev->queue->queuedata = dev;
 
+    //discarded chunks are given back, any discarded range reads as zeros
+    blk_queue_max_discard_sectors(dev->queue, UINT_MAX);
+    dev->queue->limits.discard_granularity = CHUNK_SIZE;
+    dev->queue->limits.discard_zeroes_data = 1;
+    queue_flag_set_unlocked(QUEUE_FLAG_DISCARD, dev->queue);
+
 
    //申请一个gendisk结构，初始化
-    dev->gd = alloc_disk(1);
+    dev->gd = alloc_disk_node(1, numa_node);
     if (! dev->gd) {
        printk (KERN_NOTICE "alloc_disk failure\n");
+       err = -ENOMEM;
        goto out_free2;
     }
     dev->gd->major = major;
-    dev->gd->first_minor = 0;
+    dev->gd->first_minor = dev->id;
     dev->gd->fops = &blk_ops;
     dev->gd->queue = dev->queue;
     dev->gd->private_data = dev;
-    sprintf (dev->gd->disk_name, "msfsblk%d", 0);
-    set_capacity(dev->gd, nsectors*(sect_size/sect_size));
+    sprintf (dev->gd->disk_name, "msfsblk%d", dev->id);
+    set_capacity(dev->gd, dev->size);
+
+    //the filesystem is in place before anybody can see the disk
+    err = setup_msfs_filesystem(dev, mb << 10, blk_write_block);
+    if (err) {
+       printk (KERN_NOTICE "msfs mkfs failure %d\n", err);
+       goto out_free1;
+    }
 
     //注册块设备
     add_disk(dev->gd);
+    if (device_create_file(disk_to_dev(dev->gd), &dev_attr_node_usage))
+       printk (KERN_WARNING "%s: no node_usage in sysfs\n", dev->gd->disk_name);
+    list_add_tail(&dev->list, &blk_devices);
+    return 0;
 
-    setup_msfs_filesystem(dev->data, dev->size);
-
-    return err;
+out_free1:
+    put_disk(dev->gd);
 out_free2:
     blk_cleanup_queue(dev->queue);
 out_free3:
-    //kfree(dev->data);
-//out_free4:
+    blk_free_pages(dev);
+    ida_simple_remove(&blk_ida, dev->id);
+out_free4:
+    kfree(dev->node_chunks);
+out_free5:
     kfree(dev);
-out_unregister:
+    return err;
+}
+
+static void blk_del(struct blk_dev *dev)
+{
+    list_del(&dev->list);
+    device_remove_file(disk_to_dev(dev->gd), &dev_attr_node_usage);
+    del_gendisk(dev->gd);
+    put_disk(dev->gd);
+    blk_cleanup_queue(dev->queue);
+    //pages of earlier discards still waiting for their grace period
+    rcu_barrier();
+    blk_free_pages(dev);
+    ida_simple_remove(&blk_ida, dev->id);
+    kfree(dev->node_chunks);
+    kfree(dev);
+}
+
+/*
+* /sys/class/msfsblk/add takes a size in MB, 0 for the size parameter,
+* /sys/class/msfsblk/remove the number of a device nobody has open.
+*/
+static ssize_t blk_add_store(struct class *class, struct class_attribute *attr,
+   const char *buf, size_t count)
+{
+    unsigned long mb;
+    int err;
+
+    err = kstrtoul(buf, 0, &mb);
+    if (err)
+        return err;
+    mutex_lock(&blk_devices_mutex);
+    err = blk_add(mb ? mb : size);
+    mutex_unlock(&blk_devices_mutex);
+    return err ? err : count;
+}
+
+static ssize_t blk_remove_store(struct class *class, struct class_attribute *attr,
+   const char *buf, size_t count)
+{
+    struct blk_dev *dev;
+    int id, err;
+
+    err = kstrtoint(buf, 0, &id);
+    if (err)
+        return err;
+    err = -ENODEV;
+    mutex_lock(&blk_devices_mutex);
+    list_for_each_entry(dev, &blk_devices, list) {
+        if (dev->id != id)
+            continue;
+        spin_lock(&dev->lock);
+        if (dev->users) {
+            err = -EBUSY;
+        } else {
+            dev->dying = 1;
+            err = 0;
+        }
+        spin_unlock(&dev->lock);
+        if (!err)
+            blk_del(dev);
+        break;
+    }
+    mutex_unlock(&blk_devices_mutex);
+    return err ? err : count;
+}
+
+static CLASS_ATTR(add, S_IWUSR, NULL, blk_add_store);
+static CLASS_ATTR(remove, S_IWUSR, NULL, blk_remove_store);
+
+static struct class *blk_class;
+
+static void blk_del_all(void)
+{
+    struct blk_dev *dev, *next;
+
+    mutex_lock(&blk_devices_mutex);
+    list_for_each_entry_safe(dev, next, &blk_devices, list)
+        blk_del(dev);
+    mutex_unlock(&blk_devices_mutex);
+}
+
+static int __init blk_init(void)
+{
+    int err = 0, i;
+
+    if (nr_devs < 0 || nr_devs > (1 << MINORBITS))
+        return -EINVAL;
+    if (chunk_order < 0 || chunk_order >= MAX_ORDER) {
+        printk(KERN_WARNING "blk: chunk_order must be below %d\n", MAX_ORDER);
+        return -EINVAL;
+    }
+    if (numa_node != NUMA_NO_NODE &&
+        (numa_node < 0 || numa_node >= nr_node_ids || !node_online(numa_node))) {
+        printk(KERN_WARNING "blk: node %d is not online\n", numa_node);
+        return -EINVAL;
+    }
+
+    //注册设备块驱动程序
+    major = register_blkdev(0, "blk");
+    if (major <= 0) {
+       printk(KERN_WARNING "blk: unable to get major number\n");
+       return -EBUSY;
+    }
+
+    mutex_lock(&blk_devices_mutex);
+    for (i = 0; i < nr_devs && !err; i++)
+        err = blk_add(size);
+    mutex_unlock(&blk_devices_mutex);
+    if (err)
+        goto out_del;
+
+    blk_class = class_create(THIS_MODULE, "msfsblk");
+    if (IS_ERR(blk_class)) {
+        err = PTR_ERR(blk_class);
+        goto out_del;
+    }
+    err = class_create_file(blk_class, &class_attr_add);
+    if (err)
+        goto out_class;
+    err = class_create_file(blk_class, &class_attr_remove);
+    if (err)
+        goto out_add;
+    return 0;
+
+out_add:
+    class_remove_file(blk_class, &class_attr_add);
+out_class:
+    class_destroy(blk_class);
+out_del:
+    blk_del_all();
     unregister_blkdev(major, "blk");
     return err;
 }
 static void blk_exit(void)
 {
-   if (dev->gd) {
-        del_gendisk(dev->gd);
-        put_disk(dev->gd);
-   }
-   if (dev->queue)
-        blk_cleanup_queue(dev->queue);
-#if 0
-   if (dev->data)
-        kfree(dev->data);
-#endif
+    //no more add or remove once the class is gone
+    class_remove_file(blk_class, &class_attr_remove);
+    class_remove_file(blk_class, &class_attr_add);
+    class_destroy(blk_class);
+    blk_del_all();
     unregister_blkdev(major, "blk");
-    kfree(dev);
 }
 
 module_init(blk_init);
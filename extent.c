@@ -0,0 +1,682 @@
+#include "inode.h"
+
+/*
+ * Extent tree mapping file blocks, the root lives in msfs_inode.i_zone[].
+ *
+ * Index keys are the first logical block of the child, only the first index
+ * of a node is a catch-all for everything left of its neighbour. Callers
+ * hold msfs_i(inode)->i_data_sem, shared for lookups and exclusive for
+ * anything that changes the tree.
+ */
+
+struct msfs_ext_path {
+    struct buffer_head *p_bh; //NULL for the root in the inode
+    struct msfs_extent_header *p_hdr;
+    struct msfs_extent_idx *p_idx;
+    struct msfs_extent *p_ext;
+};
+
+#define EXT_FIRST_EXTENT(eh) ((struct msfs_extent *)((eh) + 1))
+#define EXT_FIRST_INDEX(eh) ((struct msfs_extent_idx *)((eh) + 1))
+#define EXT_ENTRY_SIZE sizeof(struct msfs_extent)
+
+static inline struct msfs_extent_header *msfs_ext_root(struct inode *inode)
+{
+    return (struct msfs_extent_header *)msfs_i(inode)->mfs_inode.i_zone;
+}
+
+void msfs_ext_tree_init(struct inode *inode)
+{
+    struct msfs_extent_header *eh = msfs_ext_root(inode);
+
+    BUILD_BUG_ON(sizeof(struct msfs_extent) != sizeof(struct msfs_extent_idx));
+    memset(msfs_i(inode)->mfs_inode.i_zone, 0, sizeof(msfs_i(inode)->mfs_inode.i_zone));
+    eh->eh_magic = MSFS_EXT_MAGIC;
+    eh->eh_max = MSFS_EXT_ROOT_MAX;
+}
+
+static int msfs_ext_check(struct inode *inode, struct msfs_extent_header *eh,
+            int depth, int max)
+{
+    if (eh->eh_magic != MSFS_EXT_MAGIC || eh->eh_depth != depth ||
+        eh->eh_max > max || eh->eh_entries > eh->eh_max ||
+        (depth && !eh->eh_entries)) {
+        printk("msfs: bad extent node in inode %lu\n", inode->i_ino);
+        return -EIO;
+    }
+    return 0;
+}
+
+static int msfs_ext_check_root(struct inode *inode)
+{
+    struct msfs_extent_header *eh = msfs_ext_root(inode);
+
+    if (eh->eh_depth > MSFS_EXT_MAX_DEPTH)
+        return -EIO;
+    return msfs_ext_check(inode, eh, eh->eh_depth, MSFS_EXT_ROOT_MAX);
+}
+
+static void msfs_ext_drop_path(struct msfs_ext_path *path, int depth)
+{
+    int i;
+
+    for (i = 0; i <= depth; i++) {
+        brelse(path[i].p_bh);
+        path[i].p_bh = NULL;
+    }
+}
+
+static void msfs_ext_dirty(struct inode *inode, struct msfs_ext_path *p)
+{
+    if (p->p_bh)
+        mark_buffer_dirty(p->p_bh);
+    else
+        mark_inode_dirty(inode);
+}
+
+/* last index whose key is <= block, the first one if there is none */
+static struct msfs_extent_idx *msfs_ext_bsearch_idx(struct msfs_extent_header *eh,
+            sector_t block)
+{
+    struct msfs_extent_idx *l = EXT_FIRST_INDEX(eh) + 1;
+    struct msfs_extent_idx *r = EXT_FIRST_INDEX(eh) + eh->eh_entries - 1;
+
+    while (l <= r) {
+        struct msfs_extent_idx *m = l + (r - l) / 2;
+
+        if (block < m->ei_block)
+            r = m - 1;
+        else
+            l = m + 1;
+    }
+    return l - 1;
+}
+
+/* last extent starting at or before block, NULL if there is none */
+static struct msfs_extent *msfs_ext_bsearch(struct msfs_extent_header *eh,
+            sector_t block)
+{
+    struct msfs_extent *l = EXT_FIRST_EXTENT(eh);
+    struct msfs_extent *r = EXT_FIRST_EXTENT(eh) + eh->eh_entries - 1;
+
+    while (l <= r) {
+        struct msfs_extent *m = l + (r - l) / 2;
+
+        if (block < m->ee_block)
+            r = m - 1;
+        else
+            l = m + 1;
+    }
+    return l == EXT_FIRST_EXTENT(eh) ? NULL : l - 1;
+}
+
+/* walk from the root to the leaf covering block, returns the tree depth */
+static int msfs_ext_find(struct inode *inode, sector_t block,
+            struct msfs_ext_path *path)
+{
+    struct msfs_extent_header *eh = msfs_ext_root(inode);
+    int depth, i;
+
+    if (msfs_ext_check_root(inode))
+        return -EIO;
+    depth = eh->eh_depth;
+    memset(path, 0, sizeof(*path) * (depth + 1));
+
+    for (i = 0; i < depth; i++) {
+        path[i].p_hdr = eh;
+        path[i].p_idx = msfs_ext_bsearch_idx(eh, block);
+        path[i + 1].p_bh = sb_bread(inode->i_sb, path[i].p_idx->ei_leaf);
+        if (!path[i + 1].p_bh)
+            goto err;
+        eh = (struct msfs_extent_header *)path[i + 1].p_bh->b_data;
+        if (msfs_ext_check(inode, eh, depth - i - 1, MSFS_EXT_BLOCK_MAX))
+            goto err;
+    }
+    path[depth].p_hdr = eh;
+    path[depth].p_ext = msfs_ext_bsearch(eh, block);
+    return depth;
+err:
+    msfs_ext_drop_path(path, depth);
+    return -EIO;
+}
+
+/*
+ * Map block, returns how many blocks from block on are contiguous on disk
+ * (at most max_blocks) and stores the first physical one in *phys, or 0 if
+ * the block is not mapped. The extent's flags go to *flags unless it is NULL.
+ */
+int msfs_ext_map(struct inode *inode, sector_t block, unsigned int max_blocks,
+            sector_t *phys, unsigned int *flags)
+{
+    struct msfs_ext_path path[MSFS_EXT_MAX_DEPTH + 1];
+    struct msfs_extent *ex;
+    int depth, ret = 0;
+
+    depth = msfs_ext_find(inode, block, path);
+    if (depth < 0)
+        return depth;
+
+    ex = path[depth].p_ext;
+    if (flags)
+        *flags = 0;
+    if (ex && block < ex->ee_block + ex->ee_len) {
+        *phys = ex->ee_start + (block - ex->ee_block);
+        ret = min_t(sector_t, ex->ee_block + ex->ee_len - block, max_blocks);
+        if (flags)
+            *flags = ex->ee_flags;
+    }
+    msfs_ext_drop_path(path, depth);
+    return ret;
+}
+
+/* first mapped block after the one path was found for, ~0 if there is none */
+static sector_t msfs_ext_next_mapped(struct msfs_ext_path *path, int depth)
+{
+    struct msfs_extent_header *eh = path[depth].p_hdr;
+    struct msfs_extent *next = path[depth].p_ext ? path[depth].p_ext + 1 : EXT_FIRST_EXTENT(eh);
+    int i;
+
+    if (next < EXT_FIRST_EXTENT(eh) + eh->eh_entries)
+        return next->ee_block;
+    //the key of the next index up the path starts the next leaf
+    for (i = depth - 1; i >= 0; i--) {
+        eh = path[i].p_hdr;
+        if (path[i].p_idx + 1 < EXT_FIRST_INDEX(eh) + eh->eh_entries)
+            return (path[i].p_idx + 1)->ei_block;
+    }
+    return ~(sector_t)0;
+}
+
+/*
+ * How many blocks from block on are not mapped, at most max_blocks, 0 if
+ * block itself is mapped. Index keys are only lower bounds, so after a
+ * punch the answer can be short of the next extent, never past it.
+ */
+int msfs_ext_hole(struct inode *inode, sector_t block, unsigned int max_blocks)
+{
+    struct msfs_ext_path path[MSFS_EXT_MAX_DEPTH + 1];
+    struct msfs_extent *ex;
+    int depth, ret = 0;
+
+    depth = msfs_ext_find(inode, block, path);
+    if (depth < 0)
+        return depth;
+
+    ex = path[depth].p_ext;
+    if (!ex || block >= ex->ee_block + ex->ee_len)
+        ret = min_t(sector_t, msfs_ext_next_mapped(path, depth) - block, max_blocks);
+    msfs_ext_drop_path(path, depth);
+    return ret;
+}
+
+static int msfs_ext_count(struct inode *inode, struct msfs_extent_header *eh,
+            blkcnt_t *count)
+{
+    struct msfs_extent_header *child;
+    struct msfs_extent_idx *ix;
+    struct msfs_extent *ex;
+    struct buffer_head *bh;
+    int i, err = 0;
+
+    if (!eh->eh_depth) {
+        for (i = 0, ex = EXT_FIRST_EXTENT(eh); i < eh->eh_entries; i++, ex++)
+            *count += ex->ee_len;
+        return 0;
+    }
+    for (i = 0, ix = EXT_FIRST_INDEX(eh); i < eh->eh_entries && !err; i++, ix++) {
+        bh = sb_bread(inode->i_sb, ix->ei_leaf);
+        if (!bh)
+            return -EIO;
+        child = (struct msfs_extent_header *)bh->b_data;
+        err = msfs_ext_check(inode, child, eh->eh_depth - 1, MSFS_EXT_BLOCK_MAX);
+        if (!err)
+            err = msfs_ext_count(inode, child, count);
+        brelse(bh);
+        (*count)++;
+    }
+    return err;
+}
+
+/* blocks the file holds on disk, its data and the tree nodes below the root */
+int msfs_ext_blocks(struct inode *inode, blkcnt_t *count)
+{
+    int err = msfs_ext_check_root(inode);
+
+    *count = 0;
+    if (err)
+        return err;
+    return msfs_ext_count(inode, msfs_ext_root(inode), count);
+}
+
+static struct buffer_head *msfs_ext_new_node(struct inode *inode, int depth, int *block)
+{
+    struct super_block *sb = inode->i_sb;
+    struct msfs_extent_header *eh;
+    struct buffer_head *bh;
+
+    *block = msfs_new_block(inode, 0);
+    if (!*block)
+        return ERR_PTR(-ENOSPC);
+    bh = sb_getblk(sb, *block);
+    if (!bh) {
+        msfs_free_block(sb, *block);
+        return ERR_PTR(-EIO);
+    }
+    lock_buffer(bh);
+    memset(bh->b_data, 0, bh->b_size);
+    eh = (struct msfs_extent_header *)bh->b_data;
+    eh->eh_magic = MSFS_EXT_MAGIC;
+    eh->eh_max = MSFS_EXT_BLOCK_MAX;
+    eh->eh_depth = depth;
+    return bh;
+}
+
+static void msfs_ext_put_node(struct buffer_head *bh)
+{
+    set_buffer_uptodate(bh);
+    unlock_buffer(bh);
+    mark_buffer_dirty(bh);
+    brelse(bh);
+}
+
+static __u32 msfs_ext_first_key(struct msfs_extent_header *eh)
+{
+    if (eh->eh_depth)
+        return EXT_FIRST_INDEX(eh)->ei_block;
+    return EXT_FIRST_EXTENT(eh)->ee_block;
+}
+
+/*
+ * The root is full, move its entries into a new block and leave a single
+ * index to it behind, the tree gets one level deeper.
+ */
+static int msfs_ext_grow(struct inode *inode)
+{
+    struct msfs_extent_header *eh = msfs_ext_root(inode), *neh;
+    struct msfs_extent_idx *ix;
+    struct buffer_head *bh;
+    int block;
+
+    if (eh->eh_depth >= MSFS_EXT_MAX_DEPTH)
+        return -EFBIG;
+
+    bh = msfs_ext_new_node(inode, eh->eh_depth, &block);
+    if (IS_ERR(bh))
+        return PTR_ERR(bh);
+    neh = (struct msfs_extent_header *)bh->b_data;
+    memcpy(neh + 1, eh + 1, eh->eh_entries * EXT_ENTRY_SIZE);
+    neh->eh_entries = eh->eh_entries;
+    msfs_ext_put_node(bh);
+
+    ix = EXT_FIRST_INDEX(eh);
+    ix->ei_block = msfs_ext_first_key(neh);
+    ix->ei_leaf = block;
+    ix->ei_unused = 0;
+    eh->eh_entries = 1;
+    eh->eh_depth++;
+    mark_inode_dirty(inode);
+    return 0;
+}
+
+/*
+ * Split the full node at path[at] and hook the new half into path[at - 1],
+ * which has room. Appending only moves the last entry so sequential files
+ * keep their nodes full.
+ */
+static int msfs_ext_split(struct inode *inode, struct msfs_ext_path *path,
+            int at, int depth)
+{
+    struct msfs_extent_header *eh = path[at].p_hdr, *neh;
+    struct msfs_extent_header *peh = path[at - 1].p_hdr;
+    struct msfs_extent_idx *ix;
+    struct buffer_head *bh;
+    int block, split, moved;
+
+    if (at == depth)
+        split = path[at].p_ext ? path[at].p_ext - EXT_FIRST_EXTENT(eh) + 1 : 0;
+    else
+        split = path[at].p_idx - EXT_FIRST_INDEX(eh) + 1;
+    if (split >= eh->eh_entries)
+        split = eh->eh_entries - 1;
+    else
+        split = eh->eh_entries / 2;
+    moved = eh->eh_entries - split;
+
+    bh = msfs_ext_new_node(inode, eh->eh_depth, &block);
+    if (IS_ERR(bh))
+        return PTR_ERR(bh);
+    neh = (struct msfs_extent_header *)bh->b_data;
+    memcpy(neh + 1, (char *)(eh + 1) + split * EXT_ENTRY_SIZE, moved * EXT_ENTRY_SIZE);
+    neh->eh_entries = moved;
+    eh->eh_entries = split;
+    msfs_ext_dirty(inode, &path[at]);
+
+    ix = path[at - 1].p_idx + 1;
+    memmove(ix + 1, ix, (EXT_FIRST_INDEX(peh) + peh->eh_entries - ix) * sizeof(*ix));
+    ix->ei_block = msfs_ext_first_key(neh);
+    ix->ei_leaf = block;
+    ix->ei_unused = 0;
+    peh->eh_entries++;
+    msfs_ext_dirty(inode, &path[at - 1]);
+
+    msfs_ext_put_node(bh);
+    return 0;
+}
+
+static int msfs_ext_can_append(struct msfs_extent *ex, sector_t block,
+            sector_t phys, unsigned int len, unsigned int flags)
+{
+    return ex->ee_block + ex->ee_len == block &&
+        ex->ee_start + ex->ee_len == phys &&
+        ex->ee_len + len <= MSFS_EXT_MAX_LEN &&
+        ex->ee_flags == flags;
+}
+
+static int msfs_ext_do_insert(struct inode *inode, sector_t block, sector_t phys,
+            unsigned int len, unsigned int flags, int merge)
+{
+    struct msfs_ext_path path[MSFS_EXT_MAX_DEPTH + 1];
+    struct msfs_extent_header *eh;
+    struct msfs_extent *ex, *next;
+    int depth, at, err;
+
+retry:
+    depth = msfs_ext_find(inode, block, path);
+    if (depth < 0)
+        return depth;
+    eh = path[depth].p_hdr;
+    ex = path[depth].p_ext;
+
+    if (merge && ex && msfs_ext_can_append(ex, block, phys, len, flags)) {
+        ex->ee_len += len;
+        goto out;
+    }
+
+    next = ex ? ex + 1 : EXT_FIRST_EXTENT(eh);
+    if (merge && next < EXT_FIRST_EXTENT(eh) + eh->eh_entries &&
+        next->ee_block == block + len && next->ee_start == phys + len &&
+        next->ee_len + len <= MSFS_EXT_MAX_LEN && next->ee_flags == flags) {
+        next->ee_block = block;
+        next->ee_start = phys;
+        next->ee_len += len;
+        goto out;
+    }
+
+    if (eh->eh_entries < eh->eh_max) {
+        memmove(next + 1, next, (EXT_FIRST_EXTENT(eh) + eh->eh_entries - next) * sizeof(*next));
+        next->ee_block = block;
+        next->ee_start = phys;
+        next->ee_len = len;
+        next->ee_flags = flags;
+        eh->eh_entries++;
+        goto out;
+    }
+
+    /* leaf is full, split below the deepest node that still has room */
+    for (at = depth - 1; at >= 0; at--)
+        if (path[at].p_hdr->eh_entries < path[at].p_hdr->eh_max)
+            break;
+    if (at < 0)
+        err = msfs_ext_grow(inode);
+    else
+        err = msfs_ext_split(inode, path, at + 1, depth);
+    msfs_ext_drop_path(path, depth);
+    if (err)
+        return err;
+    goto retry;
+
+out:
+    msfs_ext_dirty(inode, &path[depth]);
+    msfs_ext_drop_path(path, depth);
+    return 0;
+}
+
+/*
+ * Map len blocks at block to phys..phys + len - 1 with flags, the range
+ * must not be mapped yet. Runs that continue a neighbour with the same
+ * flags are merged into it.
+ */
+int msfs_ext_insert(struct inode *inode, sector_t block, sector_t phys,
+            unsigned int len, unsigned int flags)
+{
+    return msfs_ext_do_insert(inode, block, phys, len, flags, 1);
+}
+
+/*
+ * Cut the extent running across block in two with the same flags, so the
+ * caller can change or remove the part on either side alone. On error the
+ * tree maps what it did before.
+ */
+static int msfs_ext_split_at(struct inode *inode, sector_t block)
+{
+    struct msfs_ext_path path[MSFS_EXT_MAX_DEPTH + 1];
+    struct msfs_extent *ex;
+    unsigned int len, tail, flags;
+    sector_t phys;
+    int depth, err;
+
+    depth = msfs_ext_find(inode, block, path);
+    if (depth < 0)
+        return depth;
+    ex = path[depth].p_ext;
+    if (!ex || block == ex->ee_block || block >= ex->ee_block + ex->ee_len) {
+        msfs_ext_drop_path(path, depth);
+        return 0;
+    }
+    len = ex->ee_len;
+    flags = ex->ee_flags;
+    phys = ex->ee_start + (block - ex->ee_block);
+    tail = ex->ee_block + len - block;
+    ex->ee_len -= tail;
+    msfs_ext_dirty(inode, &path[depth]);
+    msfs_ext_drop_path(path, depth);
+
+    err = msfs_ext_do_insert(inode, block, phys, tail, flags, 0);
+    if (err) {
+        //the head gets its tail back, the failed insert changed no mapping
+        depth = msfs_ext_find(inode, block - 1, path);
+        if (depth >= 0) {
+            ex = path[depth].p_ext;
+            ex->ee_len = len;
+            msfs_ext_dirty(inode, &path[depth]);
+            msfs_ext_drop_path(path, depth);
+        }
+    }
+    return err;
+}
+
+/*
+ * A node emptied by a removal goes away together with its index, up to
+ * the root which just becomes an empty leaf.
+ */
+static void msfs_ext_rm_empty(struct inode *inode, struct msfs_ext_path *path, int depth)
+{
+    struct msfs_extent_header *peh;
+    struct msfs_extent_idx *ix;
+    int i;
+
+    for (i = depth; i > 0 && !path[i].p_hdr->eh_entries; i--) {
+        peh = path[i - 1].p_hdr;
+        ix = path[i - 1].p_idx;
+        bforget(path[i].p_bh);
+        path[i].p_bh = NULL;
+        msfs_free_block(inode->i_sb, ix->ei_leaf);
+        memmove(ix, ix + 1, (EXT_FIRST_INDEX(peh) + peh->eh_entries - ix - 1) * sizeof(*ix));
+        peh->eh_entries--;
+        msfs_ext_dirty(inode, &path[i - 1]);
+    }
+    if (!path[0].p_hdr->eh_entries && path[0].p_hdr->eh_depth) {
+        path[0].p_hdr->eh_depth = 0;
+        mark_inode_dirty(inode);
+    }
+}
+
+/*
+ * Preallocated blocks block..block + len - 1 become written. A converted
+ * extent is merged with written neighbours in the same leaf, so a file
+ * written front to back after fallocate ends up with one extent again.
+ */
+int msfs_ext_convert(struct inode *inode, sector_t block, unsigned int len)
+{
+    struct msfs_ext_path path[MSFS_EXT_MAX_DEPTH + 1];
+    struct msfs_extent_header *eh;
+    struct msfs_extent *ex, *prev, *next;
+    sector_t end = block + len, n;
+    int depth, err;
+
+    err = msfs_ext_split_at(inode, block);
+    if (!err)
+        err = msfs_ext_split_at(inode, end);
+    if (err)
+        return err;
+
+    while (block < end) {
+        depth = msfs_ext_find(inode, block, path);
+        if (depth < 0)
+            return depth;
+        eh = path[depth].p_hdr;
+        ex = path[depth].p_ext;
+        if (!ex || block >= ex->ee_block + ex->ee_len) {
+            block = msfs_ext_next_mapped(path, depth);
+            msfs_ext_drop_path(path, depth);
+            continue;
+        }
+        n = ex->ee_block + ex->ee_len;
+        ex->ee_flags &= ~MSFS_EXT_UNWRITTEN;
+
+        next = ex + 1;
+        if (next < EXT_FIRST_EXTENT(eh) + eh->eh_entries &&
+            msfs_ext_can_append(ex, next->ee_block, next->ee_start, next->ee_len,
+                        next->ee_flags)) {
+            ex->ee_len += next->ee_len;
+            memmove(next, next + 1, (EXT_FIRST_EXTENT(eh) + eh->eh_entries - next - 1) *
+                        sizeof(*next));
+            eh->eh_entries--;
+        }
+        prev = ex - 1;
+        if (ex > EXT_FIRST_EXTENT(eh) &&
+            msfs_ext_can_append(prev, ex->ee_block, ex->ee_start, ex->ee_len, ex->ee_flags)) {
+            prev->ee_len += ex->ee_len;
+            memmove(ex, ex + 1, (EXT_FIRST_EXTENT(eh) + eh->eh_entries - ex - 1) *
+                        sizeof(*ex));
+            eh->eh_entries--;
+        }
+        msfs_ext_dirty(inode, &path[depth]);
+        msfs_ext_drop_path(path, depth);
+        block = n;
+    }
+    return 0;
+}
+
+/* unmap and free blocks start..end - 1, extents across either end are cut */
+int msfs_ext_punch(struct inode *inode, sector_t start, sector_t end)
+{
+    struct msfs_ext_path path[MSFS_EXT_MAX_DEPTH + 1];
+    struct msfs_extent_header *eh;
+    struct msfs_extent *ex;
+    int depth, err;
+
+    err = msfs_ext_split_at(inode, start);
+    if (!err)
+        err = msfs_ext_split_at(inode, end);
+    if (err)
+        return err;
+
+    while (start < end) {
+        depth = msfs_ext_find(inode, start, path);
+        if (depth < 0)
+            return depth;
+        eh = path[depth].p_hdr;
+        ex = path[depth].p_ext;
+        if (!ex || start >= ex->ee_block + ex->ee_len) {
+            start = msfs_ext_next_mapped(path, depth);
+            msfs_ext_drop_path(path, depth);
+            continue;
+        }
+        start = ex->ee_block + ex->ee_len;
+        msfs_free_blocks(inode->i_sb, ex->ee_start, ex->ee_len);
+        memmove(ex, ex + 1, (EXT_FIRST_EXTENT(eh) + eh->eh_entries - ex - 1) * sizeof(*ex));
+        eh->eh_entries--;
+        msfs_ext_dirty(inode, &path[depth]);
+        msfs_ext_rm_empty(inode, path, depth);
+        msfs_ext_drop_path(path, depth);
+    }
+    mark_inode_dirty(inode);
+    return 0;
+}
+
+static void msfs_ext_rm_leaf(struct inode *inode, struct msfs_extent_header *eh,
+            sector_t start)
+{
+    struct msfs_extent *ex = EXT_FIRST_EXTENT(eh) + eh->eh_entries - 1;
+    unsigned int keep;
+
+    for (; ex >= EXT_FIRST_EXTENT(eh); ex--) {
+        if (ex->ee_block + ex->ee_len <= start)
+            break;
+        if (ex->ee_block >= start) {
+            msfs_free_blocks(inode->i_sb, ex->ee_start, ex->ee_len);
+            eh->eh_entries--;
+            continue;
+        }
+        keep = start - ex->ee_block;
+        msfs_free_blocks(inode->i_sb, ex->ee_start + keep, ex->ee_len - keep);
+        ex->ee_len = keep;
+        break;
+    }
+}
+
+static int msfs_ext_rm_node(struct inode *inode, struct msfs_extent_header *eh,
+            sector_t start)
+{
+    struct msfs_extent_header *child;
+    struct msfs_extent_idx *ix;
+    struct buffer_head *bh;
+    int err;
+
+    if (!eh->eh_depth) {
+        msfs_ext_rm_leaf(inode, eh, start);
+        return 0;
+    }
+
+    while (eh->eh_entries) {
+        ix = EXT_FIRST_INDEX(eh) + eh->eh_entries - 1;
+        bh = sb_bread(inode->i_sb, ix->ei_leaf);
+        if (!bh)
+            return -EIO;
+        child = (struct msfs_extent_header *)bh->b_data;
+        err = msfs_ext_check(inode, child, eh->eh_depth - 1, MSFS_EXT_BLOCK_MAX);
+        if (!err)
+            err = msfs_ext_rm_node(inode, child, start);
+        if (err) {
+            brelse(bh);
+            return err;
+        }
+        if (child->eh_entries) {
+            /* everything left of this child lies before start */
+            mark_buffer_dirty(bh);
+            brelse(bh);
+            break;
+        }
+        bforget(bh);
+        msfs_free_block(inode->i_sb, ix->ei_leaf);
+        eh->eh_entries--;
+    }
+    return 0;
+}
+
+/* unmap and free every block from start to the end of the file */
+int msfs_ext_truncate(struct inode *inode, sector_t start)
+{
+    struct msfs_extent_header *eh = msfs_ext_root(inode);
+    int err;
+
+    err = msfs_ext_check_root(inode);
+    if (err)
+        return err;
+    err = msfs_ext_rm_node(inode, eh, start);
+    if (!eh->eh_entries)
+        eh->eh_depth = 0;
+    mark_inode_dirty(inode);
+    return err;
+}
@@ -0,0 +1,224 @@
+#include <linux/slab.h>
+#include <linux/rbtree_augmented.h>
+#include "inode.h"
+
+/*
+ * Free extents of a group, in memory only. The tree holds every block that
+ * is free in the bitmap and not inside a reservation window, as runs keyed
+ * by their first bit. Every node also knows the longest run below it, so
+ * "len free blocks at or after goal" is one walk down the tree instead of
+ * a bitmap scan per block.
+ *
+ * Built from the bitmap at mount and kept in step by the allocator, always
+ * under gi->lock. A node that cannot be allocated there only hides its
+ * blocks from the tree until the next mount, the bitmap stays the truth.
+ */
+
+struct msfs_free_ext {
+    struct rb_node node;
+    unsigned int start;
+    unsigned int len;
+    unsigned int max_len; //longest run in this subtree
+};
+
+static struct kmem_cache *msfs_fe_cachep;
+
+static inline unsigned int msfs_fe_compute_max(struct msfs_free_ext *fe)
+{
+    unsigned int max = fe->len;
+    struct msfs_free_ext *child;
+
+    if (fe->node.rb_left) {
+        child = rb_entry(fe->node.rb_left, struct msfs_free_ext, node);
+        if (child->max_len > max)
+            max = child->max_len;
+    }
+    if (fe->node.rb_right) {
+        child = rb_entry(fe->node.rb_right, struct msfs_free_ext, node);
+        if (child->max_len > max)
+            max = child->max_len;
+    }
+    return max;
+}
+
+RB_DECLARE_CALLBACKS(static, msfs_fe_callbacks, struct msfs_free_ext, node,
+                     unsigned int, max_len, msfs_fe_compute_max)
+
+//the run holding bit, NULL when bit is not in the tree
+static struct msfs_free_ext *msfs_fe_lookup(struct rb_root *root, unsigned int bit)
+{
+    struct rb_node *n = root->rb_node;
+    struct msfs_free_ext *fe;
+
+    while (n) {
+        fe = rb_entry(n, struct msfs_free_ext, node);
+        if (bit < fe->start)
+            n = n->rb_left;
+        else if (bit >= fe->start + fe->len)
+            n = n->rb_right;
+        else
+            return fe;
+    }
+    return NULL;
+}
+
+//leftmost run starting at or after goal with at least len blocks
+static struct msfs_free_ext *msfs_fe_first_fit(struct rb_node *n, unsigned int goal,
+            unsigned int len)
+{
+    struct msfs_free_ext *fe, *left;
+
+    while (n) {
+        fe = rb_entry(n, struct msfs_free_ext, node);
+        if (fe->max_len < len)
+            return NULL;
+        if (fe->start >= goal) {
+            left = msfs_fe_first_fit(n->rb_left, goal, len);
+            if (left)
+                return left;
+            if (fe->len >= len)
+                return fe;
+        }
+        n = n->rb_right;
+    }
+    return NULL;
+}
+
+/*
+ * First bit from goal on where len free blocks follow each other, goal
+ * itself when its run is long enough, -1 when the group has none.
+ */
+int msfs_fe_find(struct msfs_group_info *gi, unsigned int goal, unsigned int len)
+{
+    struct msfs_free_ext *fe = msfs_fe_lookup(&gi->free_tree, goal);
+
+    if (fe && fe->start + fe->len - goal >= len)
+        return goal;
+    fe = msfs_fe_first_fit(gi->free_tree.rb_node, goal, len);
+    return fe ? fe->start : -1;
+}
+
+//free blocks in the tree from bit on, 0 when bit is not there
+unsigned int msfs_fe_run(struct msfs_group_info *gi, unsigned int bit)
+{
+    struct msfs_free_ext *fe = msfs_fe_lookup(&gi->free_tree, bit);
+
+    return fe ? fe->start + fe->len - bit : 0;
+}
+
+//remove start..start+len from the tree, it must lie in one run
+void msfs_fe_take(struct msfs_group_info *gi, unsigned int start, unsigned int len)
+{
+    struct msfs_free_ext *fe = msfs_fe_lookup(&gi->free_tree, start);
+    unsigned int end;
+
+    if (!fe)
+        return;
+    end = fe->start + fe->len;
+    if (start + len > end)
+        len = end - start;
+
+    if (fe->start == start && start + len == end) {
+        rb_erase_augmented(&fe->node, &gi->free_tree, &msfs_fe_callbacks);
+        kmem_cache_free(msfs_fe_cachep, fe);
+        return;
+    }
+    if (fe->start == start) {
+        fe->start += len;
+        fe->len -= len;
+        msfs_fe_callbacks.propagate(&fe->node, NULL);
+        return;
+    }
+    //split, the tail becomes a run of its own
+    fe->len = start - fe->start;
+    msfs_fe_callbacks.propagate(&fe->node, NULL);
+    if (start + len < end)
+        msfs_fe_give(gi, start + len, end - start - len);
+}
+
+//add start..start+len to the tree, merged with the runs on either side
+void msfs_fe_give(struct msfs_group_info *gi, unsigned int start, unsigned int len)
+{
+    struct rb_node **p = &gi->free_tree.rb_node, *parent = NULL;
+    struct msfs_free_ext *fe, *prev = NULL, *next = NULL;
+
+    while (*p) {
+        parent = *p;
+        fe = rb_entry(parent, struct msfs_free_ext, node);
+        if (start < fe->start) {
+            next = fe;
+            p = &parent->rb_left;
+        } else {
+            prev = fe;
+            p = &parent->rb_right;
+        }
+    }
+    if ((prev && prev->start + prev->len > start) || (next && start + len > next->start)) {
+        printk("msfs: free extent %u+%u overlaps the tree\n", start, len);
+        return;
+    }
+
+    if (prev && prev->start + prev->len == start) {
+        if (next && start + len == next->start) {
+            len += next->len;
+            rb_erase_augmented(&next->node, &gi->free_tree, &msfs_fe_callbacks);
+            kmem_cache_free(msfs_fe_cachep, next);
+        }
+        prev->len += len;
+        msfs_fe_callbacks.propagate(&prev->node, NULL);
+        return;
+    }
+    if (next && start + len == next->start) {
+        next->start = start;
+        next->len += len;
+        msfs_fe_callbacks.propagate(&next->node, NULL);
+        return;
+    }
+
+    fe = kmem_cache_alloc(msfs_fe_cachep, GFP_ATOMIC);
+    if (!fe)
+        return;
+    fe->start = start;
+    fe->len = fe->max_len = len;
+    rb_link_node(&fe->node, parent, p);
+    rb_insert_augmented(&fe->node, &gi->free_tree, &msfs_fe_callbacks);
+}
+
+//the tree of a group from its bitmap, at mount before anybody allocates
+int msfs_fe_build(struct msfs_group_info *gi, unsigned int blocks)
+{
+    void *bitmap = gi->block_bitmap->b_data;
+    unsigned int start = 0, end;
+
+    gi->free_tree = RB_ROOT;
+    while ((start = find_next_zero_bit_le(bitmap, blocks, start)) < blocks) {
+        end = find_next_bit_le(bitmap, blocks, start);
+        msfs_fe_give(gi, start, end - start);
+        if (!msfs_fe_lookup(&gi->free_tree, start))
+            return -ENOMEM;
+        start = end;
+    }
+    return 0;
+}
+
+void msfs_fe_destroy(struct msfs_group_info *gi)
+{
+    struct rb_node *n;
+
+    while ((n = rb_first(&gi->free_tree))) {
+        rb_erase(n, &gi->free_tree);
+        kmem_cache_free(msfs_fe_cachep, rb_entry(n, struct msfs_free_ext, node));
+    }
+}
+
+int msfs_fe_init(void)
+{
+    msfs_fe_cachep = kmem_cache_create("msfs_free_ext", sizeof(struct msfs_free_ext),
+                                       0, SLAB_RECLAIM_ACCOUNT, NULL);
+    return msfs_fe_cachep ? 0 : -ENOMEM;
+}
+
+void msfs_fe_exit(void)
+{
+    kmem_cache_destroy(msfs_fe_cachep);
+}
@@ -5,6 +5,9 @@
 #include <linux/highuid.h>
 #include <linux/vfs.h>
 #include <linux/writeback.h>
+#include <linux/parser.h>
+#include <linux/seq_file.h>
+#include <linux/blkdev.h>
 #include "msfs.h"
 #include "msfs_info.h"
 #include "inode.h"
@@ -17,6 +20,8 @@ static void init_once(void *foo)
 {
 	struct msfs_inode_info *ei = (struct msfs_inode_info *) foo;
 
+	init_rwsem(&ei->i_data_sem);
+	ei->i_nc = NULL;
 	inode_init_once(&ei->vfs_inode);
 }
 
@@ -86,9 +91,13 @@ static int msfs_write_inode(struct inode *inode, struct writeback_control *wbc)
 static void msfs_evict_inode(struct inode *inode)
 {
 	truncate_inode_pages(&inode->i_data, 0);
+    if (S_ISDIR(inode->i_mode))
+        msfs_nc_drop(inode);
     if (!(S_ISREG(inode->i_mode) || S_ISDIR(inode->i_mode) || S_ISLNK(inode->i_mode))) {
         return;
     }
+	if (S_ISREG(inode->i_mode))
+		msfs_discard_reservation(inode);
 	if (!inode->i_nlink) {
 		inode->i_size = 0;
         msfs_truncate(inode);
@@ -99,22 +108,61 @@ static void msfs_evict_inode(struct inode *inode)
         msfs_free_inode(inode);
 }
 
+static void msfs_put_groups(struct msfs_sb_info *sbi)
+{
+    unsigned long i;
+
+    msfs_itable_destroy(sbi);
+    if (sbi->s_groups) {
+        for (i = 0; i < sbi->s_groups_count; i++) {
+            brelse(sbi->s_groups[i].block_bitmap);
+            brelse(sbi->s_groups[i].inode_bitmap);
+            kfree(sbi->s_groups[i].rsv_bitmap);
+            msfs_fe_destroy(&sbi->s_groups[i]);
+        }
+    }
+    if (sbi->s_gdt) {
+        for (i = 0; i < sbi->s_gdt_blocks; i++)
+            brelse(sbi->s_gdt[i]);
+    }
+    kfree(sbi->s_groups);
+    kfree(sbi->s_gdt);
+}
+
+//store the in memory free counts in the superblock
+static void msfs_write_super_counts(struct super_block *sb)
+{
+    struct msfs_sb_info *sbi = msfs_sb(sb);
+
+    sbi->s_ms->s_free_blocks_count = percpu_counter_sum_positive(&sbi->s_freeblocks_counter);
+    sbi->s_ms->s_free_inodes_count = percpu_counter_sum_positive(&sbi->s_freeinodes_counter);
+    mark_buffer_dirty(sbi->s_sbh);
+}
+
+static int msfs_sync_fs(struct super_block *sb, int wait)
+{
+    struct msfs_sb_info *sbi = msfs_sb(sb);
+
+    if (sb->s_flags & MS_RDONLY)
+        return 0;
+    msfs_write_super_counts(sb);
+    if (wait)
+        sync_dirty_buffer(sbi->s_sbh);
+    return 0;
+}
+
 static void msfs_put_super(struct super_block *sb)
 {
-    int i;
     struct msfs_sb_info *sbi = msfs_sb(sb);
 
     if (!(sb->s_flags & MS_RDONLY)) {
-        mark_buffer_dirty(sbi->s_sbh);
-    }
-    for (i = 0; i < sbi->s_ms->s_imap_blocks; i++) {
-        brelse(sbi->s_imap[i]);
-    }
-    for (i = 0; i < sbi->s_ms->s_zmap_blocks; i++) {
-        brelse(sbi->s_zmap[i]);
+        msfs_write_super_counts(sb);
     }
+    percpu_counter_destroy(&sbi->s_freeblocks_counter);
+    percpu_counter_destroy(&sbi->s_freeinodes_counter);
+    percpu_counter_destroy(&sbi->s_dirtyblocks_counter);
+    msfs_put_groups(sbi);
     brelse (sbi->s_sbh);
-    kfree(sbi->s_imap);
     sb->s_fs_info = NULL;
     kfree(sbi);
 }
@@ -126,19 +174,81 @@ static int msfs_statfs(struct dentry *dentry, struct kstatfs *buf)
     u64 id = huge_encode_dev(sb->s_bdev->bd_dev);
     buf->f_type = sb->s_magic;
     buf->f_bsize = sb->s_blocksize;
-    buf->f_blocks = (sbi->s_ms->s_nzones - sbi->s_ms->s_firstdatazone - 1);
-    buf->f_bfree = msfs_count_free_blocks(sb);
+    //group bitmaps and inode tables are never available for data
+    buf->f_blocks = sbi->s_blocks_count - sbi->s_first_data_block -
+        sbi->s_groups_count * (2 + sbi->s_itb_per_group);
+    //blocks promised to delayed writes are as good as gone
+    buf->f_bfree = max_t(s64, 0, percpu_counter_read_positive(&sbi->s_freeblocks_counter) -
+        percpu_counter_read_positive(&sbi->s_dirtyblocks_counter));
     buf->f_bavail = buf->f_bfree;
-    buf->f_files = sbi->s_ms->s_ninodes;
-    buf->f_ffree = msfs_count_free_inodes(sb);
+    buf->f_files = sbi->s_inodes_count;
+    buf->f_ffree = percpu_counter_read_positive(&sbi->s_freeinodes_counter);
     buf->f_namelen = MSFS_FILENAME_MAX_LEN;
     buf->f_fsid.val[0] = (u32)id;
     buf->f_fsid.val[1] = (u32)(id >> 32);
     return 0;
 }
 
+enum {
+	Opt_discard, Opt_nodiscard, Opt_err
+};
+
+static const match_table_t tokens = {
+	{Opt_discard, "discard"},
+	{Opt_nodiscard, "nodiscard"},
+	{Opt_err, NULL}
+};
+
+static int msfs_parse_options(char *options, struct super_block *sb,
+			      unsigned long *mount_opt)
+{
+	substring_t args[MAX_OPT_ARGS];
+	char *p;
+
+	if (!options)
+		return 0;
+	while ((p = strsep(&options, ",")) != NULL) {
+		if (!*p)
+			continue;
+		switch (match_token(p, tokens, args)) {
+		case Opt_discard:
+			*mount_opt |= MSFS_MOUNT_DISCARD;
+			break;
+		case Opt_nodiscard:
+			*mount_opt &= ~MSFS_MOUNT_DISCARD;
+			break;
+		default:
+			printk("msfs: unrecognized mount option \"%s\"\n", p);
+			return -EINVAL;
+		}
+	}
+	if ((*mount_opt & MSFS_MOUNT_DISCARD) &&
+	    !blk_queue_discard(bdev_get_queue(sb->s_bdev))) {
+		printk("msfs: %s does not support discard, option ignored\n", sb->s_id);
+		*mount_opt &= ~MSFS_MOUNT_DISCARD;
+	}
+	return 0;
+}
+
 static int msfs_remount (struct super_block * sb, int * flags, char * data)
 {
+    struct msfs_sb_info *sbi = msfs_sb(sb);
+    unsigned long mount_opt = sbi->s_mount_opt;
+    int err;
+
+    err = msfs_parse_options(data, sb, &mount_opt);
+    if (err)
+        return err;
+    sbi->s_mount_opt = mount_opt;
+    return 0;
+}
+
+static int msfs_show_options(struct seq_file *seq, struct dentry *root)
+{
+    struct msfs_sb_info *sbi = msfs_sb(root->d_sb);
+
+    if (sbi->s_mount_opt & MSFS_MOUNT_DISCARD)
+        seq_puts(seq, ",discard");
     return 0;
 }
 
@@ -148,25 +258,86 @@ static const struct super_operations msfs_sops = {
 	.write_inode	= msfs_write_inode,
 	.evict_inode	= msfs_evict_inode,
 	.put_super	= msfs_put_super,
+	.sync_fs	= msfs_sync_fs,
 	.statfs		= msfs_statfs,
 	.remount_fs	= msfs_remount,
+	.show_options	= msfs_show_options,
 };
 
 
+/*
+ * Read the group descriptor table and the bitmaps of every group, the
+ * bitmaps stay pinned until umount like the old imap and zmap did. So do
+ * the inode tables when they are small, see itable.c.
+ */
+static int msfs_load_groups(struct super_block *s)
+{
+	struct msfs_sb_info *sbi = msfs_sb(s);
+	struct msfs_group_info *gi;
+	unsigned long i;
+
+	sbi->s_gdt = kzalloc(sbi->s_gdt_blocks * sizeof(struct buffer_head *), GFP_KERNEL);
+	sbi->s_groups = kzalloc(sbi->s_groups_count * sizeof(struct msfs_group_info), GFP_KERNEL);
+	if (!sbi->s_gdt || !sbi->s_groups)
+		return -ENOMEM;
+
+	for (i = 0; i < sbi->s_gdt_blocks; i++) {
+		sbi->s_gdt[i] = sb_bread(s, MSFS_GDT_BLOCK + i);
+		if (!sbi->s_gdt[i]) {
+			printk("msfs: unable to read group descriptors of %s\n", s->s_id);
+			return -EIO;
+		}
+	}
+
+	for (i = 0; i < sbi->s_groups_count; i++) {
+		unsigned long first = msfs_group_first_block(sbi, i);
+		struct msfs_group_desc *desc;
+
+		gi = &sbi->s_groups[i];
+		spin_lock_init(&gi->lock);
+		gi->desc_bh = sbi->s_gdt[i / MSFS_DESC_PER_BLOCK];
+		desc = (struct msfs_group_desc *)gi->desc_bh->b_data + i % MSFS_DESC_PER_BLOCK;
+		gi->desc = desc;
+		//the allocator takes the group to start with its bitmaps and inode table
+		if (desc->bg_block_bitmap != first || desc->bg_inode_bitmap != first + 1 ||
+		    desc->bg_inode_table != first + 2 ||
+		    2 + sbi->s_itb_per_group > msfs_group_blocks(sbi, i)) {
+			printk("msfs: group %lu of %s has a bad descriptor\n", i, s->s_id);
+			return -EINVAL;
+		}
+		gi->rsv_bitmap = kzalloc(MSFS_BLOCK_SIZE, GFP_KERNEL);
+		if (!gi->rsv_bitmap)
+			return -ENOMEM;
+		gi->block_bitmap = sb_bread(s, desc->bg_block_bitmap);
+		gi->inode_bitmap = sb_bread(s, desc->bg_inode_bitmap);
+		if (!gi->block_bitmap || !gi->inode_bitmap) {
+			printk("msfs: unable to read bitmaps of group %lu on %s\n", i, s->s_id);
+			return -EIO;
+		}
+		if (msfs_fe_build(gi, msfs_group_blocks(sbi, i)))
+			return -ENOMEM;
+	}
+	return msfs_itable_init(s);
+}
+
 static int msfs_fill_super(struct super_block *s, void *data, int silent)
 {
 	struct buffer_head *bh;
-	struct buffer_head **map;
 	struct msfs_super_block *ms;
 	struct inode *root_inode;
 	struct msfs_sb_info *sbi;
+	unsigned long free_blocks, free_inodes;
 	int ret = -EINVAL;
-	int i , block;
 	
 	sbi = kzalloc(sizeof(struct msfs_sb_info), GFP_KERNEL);
 	if (!sbi)
 		return -ENOMEM;
 	s->s_fs_info = sbi;
+
+	ret = msfs_parse_options(data, s, &sbi->s_mount_opt);
+	if (ret)
+		goto bad_device;
+	ret = -EINVAL;
 	
 	if(!sb_set_blocksize(s, MSFS_BLOCK_SIZE)) {
 		goto bad_device;
@@ -181,59 +352,112 @@ static int msfs_fill_super(struct super_block *s, void *data, int silent)
 	sbi->s_ms = ms;
 	sbi->s_sbh = bh;
 #if 0
-    printk("--magic---:%d %d %d %d %d %d\n", ms->s_magic, ms->s_nzones, ms->s_ninodes, ms->s_imap_blocks,
-           ms->s_zmap_blocks, ms->s_firstdatazone);
+    printk("--magic---:%d %d %d %d %d %d\n", ms->s_magic, ms->s_blocks_count, ms->s_inodes_count,
+           ms->s_first_data_block, ms->s_blocks_per_group, ms->s_inodes_per_group);
 #endif
-	i = (ms->s_imap_blocks + ms->s_zmap_blocks) * sizeof(bh);
+	if (ms->s_magic != MSFS_MAGIG) {
+		if (!silent)
+			printk("msfs: no msfs filesystem on %s\n", s->s_id);
+		goto bad_map;
+	}
+	if (ms->s_feature_incompat & ~MSFS_FEATURE_INCOMPAT_SUPP) {
+		printk("msfs: %s has unsupported features %x\n", s->s_id,
+			ms->s_feature_incompat & ~MSFS_FEATURE_INCOMPAT_SUPP);
+		goto bad_map;
+	}
+	if ((ms->s_feature_incompat & MSFS_FEATURE_INCOMPAT_REQ) != MSFS_FEATURE_INCOMPAT_REQ) {
+		printk("msfs: %s uses an old layout without block groups, please reformat\n", s->s_id);
+		goto bad_map;
+	}
 
-	map = kzalloc(i, GFP_KERNEL);
-	
-	if (!map) {
+	sbi->s_blocks_count = ms->s_blocks_count;
+	sbi->s_inodes_count = ms->s_inodes_count;
+	sbi->s_first_data_block = ms->s_first_data_block;
+	sbi->s_blocks_per_group = ms->s_blocks_per_group;
+	sbi->s_inodes_per_group = ms->s_inodes_per_group;
+	if (!sbi->s_blocks_per_group || sbi->s_blocks_per_group > MSFS_BITS_PER_BLOCK ||
+	    !sbi->s_inodes_per_group || sbi->s_inodes_per_group > MSFS_BITS_PER_BLOCK ||
+	    sbi->s_first_data_block <= MSFS_GDT_BLOCK ||
+	    sbi->s_blocks_count <= sbi->s_first_data_block) {
+		printk("msfs: %s has a bad group geometry\n", s->s_id);
 		goto bad_map;
 	}
-	
-	sbi->s_imap = &map[0];
-	sbi->s_zmap = &map[sbi->s_ms->s_imap_blocks];
-	
-	block = 2;
-	
-	for (i=0 ; i < sbi->s_ms->s_imap_blocks ; i++) {
-        sbi->s_imap[i] = sb_bread(s, block);
-		block++;
+	sbi->s_groups_count = DIV_ROUND_UP(sbi->s_blocks_count - sbi->s_first_data_block,
+					   sbi->s_blocks_per_group);
+	sbi->s_gdt_blocks = DIV_ROUND_UP(sbi->s_groups_count, MSFS_DESC_PER_BLOCK);
+	sbi->s_inode_size = sizeof(struct msfs_inode);
+	if (ms->s_feature_incompat & MSFS_FEATURE_INCOMPAT_INLINE_DATA)
+		sbi->s_inode_size = ms->s_inode_size;
+	if (sbi->s_inode_size < sizeof(struct msfs_inode) ||
+	    sbi->s_inode_size > MSFS_INODE_SIZE_MAX || sbi->s_inode_size % 4) {
+		printk("msfs: %s has a bad inode size %u\n", s->s_id, sbi->s_inode_size);
+		goto bad_map;
 	}
-	
-	for (i=0 ; i < sbi->s_ms->s_zmap_blocks ; i++) {
-		sbi->s_zmap[i]=sb_bread(s, block);
-		block++;
+	sbi->s_inodes_per_block = MSFS_BLOCK_SIZE / sbi->s_inode_size;
+	sbi->s_itb_per_group = DIV_ROUND_UP(sbi->s_inodes_per_group, sbi->s_inodes_per_block);
+	if (sbi->s_inodes_count != sbi->s_groups_count * sbi->s_inodes_per_group ||
+	    MSFS_GDT_BLOCK + sbi->s_gdt_blocks > sbi->s_first_data_block) {
+		printk("msfs: %s has a bad group geometry\n", s->s_id);
+		goto bad_map;
+	}
+
+	ret = msfs_load_groups(s);
+	if (ret)
+		goto root_err;
+
+	free_blocks = msfs_count_free_blocks(s);
+	free_inodes = msfs_count_free_inodes(s);
+	if (free_blocks != ms->s_free_blocks_count || free_inodes != ms->s_free_inodes_count) {
+		printk("msfs: %s free counts %u/%u do not match the bitmaps %lu/%lu, fixed\n",
+			s->s_id, ms->s_free_blocks_count, ms->s_free_inodes_count,
+			free_blocks, free_inodes);
+		ms->s_free_blocks_count = free_blocks;
+		ms->s_free_inodes_count = free_inodes;
+		if (!(s->s_flags & MS_RDONLY))
+			mark_buffer_dirty(bh);
 	}
+	ret = percpu_counter_init(&sbi->s_freeblocks_counter, free_blocks);
+	if (ret)
+		goto root_err;
+	ret = percpu_counter_init(&sbi->s_freeinodes_counter, free_inodes);
+	if (ret)
+		goto counter_err;
+	ret = percpu_counter_init(&sbi->s_dirtyblocks_counter, 0);
+	if (ret)
+		goto dirty_err;
+	ret = -EINVAL;
 	
     s->s_op = &msfs_sops;
 
     root_inode = msfs_iget(s, MSFS_ROOT_INO);
 
-    if (!root_inode)
+    if (IS_ERR(root_inode))
     {
         printk("get Root inode nll\n");
-        goto root_err;
+        ret = PTR_ERR(root_inode);
+        goto root_inode_err;
     }
 
     s->s_root = d_make_root(root_inode);
+    if (!s->s_root)
+    {
+        ret = -ENOMEM;
+        goto root_inode_err;
+    }
 	
     return 0;
+root_inode_err:
+    percpu_counter_destroy(&sbi->s_dirtyblocks_counter);
+dirty_err:
+    percpu_counter_destroy(&sbi->s_freeinodes_counter);
+counter_err:
+    percpu_counter_destroy(&sbi->s_freeblocks_counter);
 root_err:
-    for (i=0 ; i < sbi->s_ms->s_imap_blocks ; i++)
-    {
-        brelse(sbi->s_imap[i]);
-    }
-
-    for (i=0 ; i < sbi->s_ms->s_zmap_blocks ; i++)
-    {
-        brelse(sbi->s_zmap[i]);
-    }
-    kfree(map);
+    msfs_put_groups(sbi);
 bad_map:
 	brelse(bh);
 bad_device:
+	s->s_fs_info = NULL;
 	kfree(sbi);
 	return ret;
 }
@@ -259,11 +483,17 @@ static int __init init_ms_fs(void)
 	int err = init_inodecache();
 	if (err)
 		goto out1;
+	err = msfs_fe_init();
+	if (err)
+		goto out2;
 	err = register_filesystem(&ms_fs_type);
 	if (err)
 		goto out;
+	msfs_nc_init();
 	return 0;
 out:
+	msfs_fe_exit();
+out2:
 	destroy_inodecache();
 out1:
 	return err;
@@ -272,6 +502,8 @@ out1:
 static void __exit exit_ms_fs(void)
 {
     unregister_filesystem(&ms_fs_type);
+	msfs_nc_exit();
+	msfs_fe_exit();
 	destroy_inodecache();
 }
 
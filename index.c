@@ -0,0 +1,287 @@
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/log2.h>
+#include "inode.h"
+
+/*
+ * Hashed directory index. The data blocks below i_size stay a plain list
+ * of entries, the index only points into them: a lookup reads the root,
+ * one bucket and the data blocks whose record has the same hash. A full
+ * bucket doubles the table and rehashes the whole directory.
+ *
+ * Callers hold the directory i_mutex. Any trouble with the index drops
+ * MSFS_INDEX_FL and frees its blocks, the directory is searched linearly
+ * again and the next add_link builds a new index. The entries themselves
+ * never depend on the index.
+ */
+
+//FNV-1a, the hash is stored on disk so it must not change with the kernel
+static u32 msfs_dx_hash(const char *name, int len)
+{
+    u32 hash = 2166136261u;
+
+    while (len--) {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+int msfs_dx_indexed(struct inode *dir)
+{
+    return msfs_i(dir)->mfs_inode.i_flags & MSFS_INDEX_FL;
+}
+
+//free the index blocks from logical block start on
+static void msfs_dx_trim(struct inode *dir, sector_t start)
+{
+    int err;
+
+    down_write(&msfs_i(dir)->i_data_sem);
+    err = msfs_ext_punch(dir, start, MSFS_DX_BLOCK + 1 + MSFS_DX_MAX_BUCKETS);
+    up_write(&msfs_i(dir)->i_data_sem);
+    if (err)
+        printk("msfs: unable to free index blocks of directory %lu\n", dir->i_ino);
+}
+
+static void msfs_dx_drop(struct inode *dir)
+{
+    printk("msfs: dropping the index of directory %lu\n", dir->i_ino);
+    msfs_i(dir)->mfs_inode.i_flags &= ~MSFS_INDEX_FL;
+    msfs_i(dir)->i_dx_retry = 1;
+    mark_inode_dirty(dir);
+    msfs_dx_trim(dir, MSFS_DX_BLOCK);
+}
+
+static int msfs_dx_read_root(struct inode *dir, u32 *buckets)
+{
+    struct buffer_head *bh = msfs_bread(dir, MSFS_DX_BLOCK, 0);
+    struct msfs_dx_root *root;
+    int err = -EIO;
+
+    if (!bh)
+        return err;
+    root = (struct msfs_dx_root *)bh->b_data;
+    if (root->dx_magic == MSFS_DX_MAGIC && root->dx_buckets <= MSFS_DX_MAX_BUCKETS &&
+        is_power_of_2(root->dx_buckets)) {
+        *buckets = root->dx_buckets;
+        err = 0;
+    }
+    brelse(bh);
+    return err;
+}
+
+static struct buffer_head *msfs_dx_bucket(struct inode *dir, u32 hash, u32 buckets)
+{
+    struct buffer_head *bh;
+
+    bh = msfs_bread(dir, MSFS_DX_BLOCK + 1 + (hash & (buckets - 1)), 0);
+    if (bh && ((struct msfs_dx_bucket *)bh->b_data)->db_count > MSFS_DX_BUCKET_MAX) {
+        brelse(bh);
+        return NULL;
+    }
+    return bh;
+}
+
+/*
+ * Write every entry of the data blocks into a table of buckets bucket
+ * blocks, -EOVERFLOW when one bucket cannot hold its share.
+ */
+static int msfs_dx_fill(struct inode *dir, u32 buckets)
+{
+    unsigned long nblocks = dir->i_size / MSFS_BLOCK_SIZE, i;
+    struct buffer_head **bhs, *bh;
+    struct msfs_dir_entry *de;
+    struct msfs_dx_bucket *b;
+    struct msfs_dx_root *root;
+    int err = -ENOSPC;
+    u32 hash;
+
+    bhs = kcalloc(buckets, sizeof(*bhs), GFP_NOFS);
+    if (!bhs)
+        return -ENOMEM;
+    for (i = 0; i < buckets; i++) {
+        bhs[i] = msfs_bread(dir, MSFS_DX_BLOCK + 1 + i, 1);
+        if (!bhs[i])
+            goto out;
+        memset(bhs[i]->b_data, 0, bhs[i]->b_size);
+    }
+
+    msfs_dir_readahead(dir, 0, nblocks);
+    for (i = 0; i < nblocks; i++) {
+        bh = msfs_bread(dir, i, 0);
+        if (!bh) {
+            err = -EIO;
+            goto out;
+        }
+        de = (struct msfs_dir_entry *)bh->b_data;
+        for (; (char *)de < bh->b_data + MSFS_BLOCK_SIZE; de = msfs_next_entry(de)) {
+            if (!msfs_entry_ok(bh, de)) {
+                brelse(bh);
+                err = -EIO;
+                goto out;
+            }
+            if (!de->inode)
+                continue;
+            hash = msfs_dx_hash(de->name, de->name_len);
+            b = (struct msfs_dx_bucket *)bhs[hash & (buckets - 1)]->b_data;
+            if (b->db_count == MSFS_DX_BUCKET_MAX) {
+                brelse(bh);
+                err = -EOVERFLOW;
+                goto out;
+            }
+            b->db_entries[b->db_count].hash = hash;
+            b->db_entries[b->db_count].block = bh->b_blocknr;
+            b->db_count++;
+        }
+        brelse(bh);
+    }
+
+    bh = msfs_bread(dir, MSFS_DX_BLOCK, 1);
+    if (!bh)
+        goto out;
+    root = (struct msfs_dx_root *)bh->b_data;
+    memset(bh->b_data, 0, bh->b_size);
+    root->dx_magic = MSFS_DX_MAGIC;
+    root->dx_buckets = buckets;
+    mark_buffer_dirty(bh);
+    brelse(bh);
+    err = 0;
+out:
+    for (i = 0; i < buckets && bhs[i]; i++) {
+        if (!err)
+            mark_buffer_dirty(bhs[i]);
+        brelse(bhs[i]);
+    }
+    kfree(bhs);
+    return err;
+}
+
+/*
+ * (Re)build the index in place with at least buckets buckets, the blocks
+ * of the old table are written over and those it does not need any more
+ * are freed.
+ */
+static void msfs_dx_build(struct inode *dir, u32 buckets)
+{
+    int err = -EOVERFLOW;
+
+    while (buckets <= MSFS_DX_MAX_BUCKETS) {
+        err = msfs_dx_fill(dir, buckets);
+        if (err != -EOVERFLOW)
+            break;
+        buckets <<= 1;
+    }
+    if (err) {
+        msfs_dx_drop(dir);
+        //no use trying again before the directory grows
+        msfs_i(dir)->i_dx_retry = 0;
+        return;
+    }
+    msfs_dx_trim(dir, MSFS_DX_BLOCK + 1 + buckets);
+    msfs_i(dir)->mfs_inode.i_flags |= MSFS_INDEX_FL;
+    msfs_i(dir)->i_dx_retry = 0;
+    mark_inode_dirty(dir);
+}
+
+//index a directory that has grown past its first block or lost its index
+void msfs_dx_create(struct inode *dir)
+{
+    msfs_i(dir)->i_dx_retry = 0;
+    if (msfs_has_feature(dir->i_sb, MSFS_FEATURE_INCOMPAT_DIR_INDEX) &&
+        dir->i_size > MSFS_BLOCK_SIZE)
+        msfs_dx_build(dir, 1);
+}
+
+/*
+ * Returns the entry with *res holding its block, NULL when the name is not
+ * there, or an ERR_PTR when the index is unusable and has been dropped.
+ */
+struct msfs_dir_entry *msfs_dx_find(struct inode *dir, const char *name, int len,
+            struct buffer_head **res)
+{
+    u32 hash = msfs_dx_hash(name, len), buckets, i;
+    struct buffer_head *bh, *bh_block;
+    struct msfs_dx_bucket *b;
+    struct msfs_dir_entry *de;
+
+    if (msfs_dx_read_root(dir, &buckets))
+        goto fail;
+    bh = msfs_dx_bucket(dir, hash, buckets);
+    if (!bh)
+        goto fail;
+    b = (struct msfs_dx_bucket *)bh->b_data;
+    for (i = 0; i < b->db_count; i++) {
+        if (b->db_entries[i].hash != hash)
+            continue;
+        bh_block = sb_bread(dir->i_sb, b->db_entries[i].block);
+        if (!bh_block)
+            continue;
+        de = msfs_search_block(bh_block, name, len);
+        if (de) {
+            brelse(bh);
+            *res = bh_block;
+            return de;
+        }
+        brelse(bh_block);
+    }
+    brelse(bh);
+    return NULL;
+fail:
+    msfs_dx_drop(dir);
+    return ERR_PTR(-EIO);
+}
+
+//record an entry that has just been written to physical block block
+void msfs_dx_add(struct inode *dir, const char *name, int len, sector_t block)
+{
+    u32 hash = msfs_dx_hash(name, len), buckets;
+    struct buffer_head *bh;
+    struct msfs_dx_bucket *b;
+
+    if (msfs_dx_read_root(dir, &buckets))
+        goto fail;
+    bh = msfs_dx_bucket(dir, hash, buckets);
+    if (!bh)
+        goto fail;
+    b = (struct msfs_dx_bucket *)bh->b_data;
+    if (b->db_count == MSFS_DX_BUCKET_MAX) {
+        brelse(bh);
+        //the entry is already in its data block, the rebuild picks it up
+        msfs_dx_build(dir, buckets << 1);
+        return;
+    }
+    b->db_entries[b->db_count].hash = hash;
+    b->db_entries[b->db_count].block = block;
+    b->db_count++;
+    mark_buffer_dirty(bh);
+    brelse(bh);
+    return;
+fail:
+    msfs_dx_drop(dir);
+}
+
+void msfs_dx_remove(struct inode *dir, const char *name, int len, sector_t block)
+{
+    u32 hash = msfs_dx_hash(name, len), buckets, i;
+    struct buffer_head *bh;
+    struct msfs_dx_bucket *b;
+
+    if (msfs_dx_read_root(dir, &buckets))
+        goto fail;
+    bh = msfs_dx_bucket(dir, hash, buckets);
+    if (!bh)
+        goto fail;
+    b = (struct msfs_dx_bucket *)bh->b_data;
+    for (i = 0; i < b->db_count; i++) {
+        if (b->db_entries[i].hash == hash && b->db_entries[i].block == block) {
+            b->db_entries[i] = b->db_entries[--b->db_count];
+            mark_buffer_dirty(bh);
+            brelse(bh);
+            return;
+        }
+    }
+    brelse(bh);
+fail:
+    msfs_dx_drop(dir);
+}
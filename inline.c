@@ -0,0 +1,183 @@
+#include <linux/highmem.h>
+#include <linux/pagemap.h>
+#include "inode.h"
+
+/*
+ * Inline data: a regular file of at most msfs_inline_max() bytes keeps its
+ * contents in the inode, i_zone[] first and then the tail past struct
+ * msfs_inode, and has no extent tree. Reading it costs the inode table
+ * block and nothing else. Page 0 is filled from the inode and written back
+ * into it, it never gets a block. The bytes past i_size are kept zero.
+ * Short symlinks keep their target the same way, see msfs_symlink, they
+ * have no page cache and are only truncated when they are deleted.
+ *
+ * The flag only goes away, when the file outgrows the inode (or is
+ * preallocated), under i_mutex. The bytes and the flag are covered by
+ * i_data_sem like the extent root they replace.
+ */
+
+//bytes pos..pos + len of the inline data to or from buf, a NULL buf writes zeros
+static void msfs_inline_copy(struct inode *inode, char *buf, unsigned int pos,
+            unsigned int len, int write)
+{
+    struct msfs_inode_info *ei = msfs_i(inode);
+    unsigned int zone = sizeof(ei->mfs_inode.i_zone), n;
+    char *p;
+
+    while (len) {
+        if (pos < zone) {
+            p = (char *)ei->mfs_inode.i_zone + pos;
+            n = min(len, zone - pos);
+        } else {
+            p = (char *)ei->i_tail + pos - zone;
+            n = len;
+        }
+        if (!write)
+            memcpy(buf, p, n);
+        else if (buf)
+            memcpy(p, buf, n);
+        else
+            memset(p, 0, n);
+        if (buf)
+            buf += n;
+        pos += n;
+        len -= n;
+    }
+}
+
+//page 0 from the inode, zeros behind i_size
+static void msfs_inline_fill(struct inode *inode, struct page *page)
+{
+    unsigned int size = min_t(loff_t, i_size_read(inode), msfs_inline_max(inode->i_sb));
+    char *kaddr = kmap(page);
+
+    down_read(&msfs_i(inode)->i_data_sem);
+    msfs_inline_copy(inode, kaddr, 0, size, 0);
+    up_read(&msfs_i(inode)->i_data_sem);
+    memset(kaddr + size, 0, PAGE_CACHE_SIZE - size);
+    kunmap(page);
+    flush_dcache_page(page);
+    SetPageUptodate(page);
+}
+
+int msfs_inline_readpage(struct page *page)
+{
+    if (page->index == 0) {
+        msfs_inline_fill(page->mapping->host, page);
+    } else {
+        zero_user(page, 0, PAGE_CACHE_SIZE);
+        SetPageUptodate(page);
+    }
+    unlock_page(page);
+    return 0;
+}
+
+//a page written through mmap goes back into the inode
+int msfs_inline_writepage(struct page *page)
+{
+    struct inode *inode = page->mapping->host;
+    unsigned int size = min_t(loff_t, i_size_read(inode), msfs_inline_max(inode->i_sb));
+    char *kaddr;
+
+    if (page->index == 0) {
+        kaddr = kmap(page);
+        down_write(&msfs_i(inode)->i_data_sem);
+        msfs_inline_copy(inode, kaddr, 0, size, 1);
+        up_write(&msfs_i(inode)->i_data_sem);
+        kunmap(page);
+        mark_inode_dirty(inode);
+    }
+    set_page_writeback(page);
+    unlock_page(page);
+    end_page_writeback(page);
+    return 0;
+}
+
+//a write that stays inside the inode only needs page 0 up to date
+int msfs_inline_write_begin(struct address_space *mapping, unsigned flags,
+            struct page **pagep)
+{
+    struct page *page = grab_cache_page_write_begin(mapping, 0, flags);
+
+    if (!page)
+        return -ENOMEM;
+    if (!PageUptodate(page))
+        msfs_inline_fill(mapping->host, page);
+    *pagep = page;
+    return 0;
+}
+
+int msfs_inline_write_end(struct inode *inode, loff_t pos, unsigned copied,
+            struct page *page)
+{
+    char *kaddr = kmap(page);
+
+    down_write(&msfs_i(inode)->i_data_sem);
+    msfs_inline_copy(inode, kaddr + pos, pos, copied, 1);
+    up_write(&msfs_i(inode)->i_data_sem);
+    kunmap(page);
+
+    if (pos + copied > inode->i_size)
+        i_size_write(inode, pos + copied);
+    unlock_page(page);
+    page_cache_release(page);
+    mark_inode_dirty(inode);
+    return copied;
+}
+
+//the bytes past a smaller i_size read as zeros again
+void msfs_inline_truncate(struct inode *inode)
+{
+    unsigned int max = msfs_inline_max(inode->i_sb);
+    unsigned int size = min_t(loff_t, inode->i_size, max);
+
+    down_write(&msfs_i(inode)->i_data_sem);
+    msfs_inline_copy(inode, NULL, size, max - size, 1);
+    up_write(&msfs_i(inode)->i_data_sem);
+    mark_inode_dirty(inode);
+}
+
+/*
+ * The file outgrows the inode: an empty extent tree takes the place of the
+ * data, which stays in page 0 and gets a delayed block 0 like any other
+ * write. If not even that can be reserved the file stays inline.
+ */
+int msfs_inline_spill(struct inode *inode)
+{
+    struct msfs_inode_info *ei = msfs_i(inode);
+    unsigned int size = inode->i_size;
+    struct page *page;
+    char *kaddr;
+    int err = 0;
+
+    page = find_or_create_page(inode->i_mapping, 0, GFP_NOFS);
+    if (!page)
+        return -ENOMEM;
+    if (!PageUptodate(page))
+        msfs_inline_fill(inode, page);
+
+    down_write(&ei->i_data_sem);
+    ei->mfs_inode.i_flags &= ~MSFS_INLINE_DATA_FL;
+    memset(ei->i_tail, 0, sizeof(ei->i_tail));
+    msfs_ext_tree_init(inode);
+    up_write(&ei->i_data_sem);
+
+    if (size) {
+        err = __block_write_begin(page, 0, size, msfs_da_get_block);
+        if (!err) {
+            block_commit_write(page, 0, size);
+        } else {
+            kaddr = kmap(page);
+            down_write(&ei->i_data_sem);
+            ei->mfs_inode.i_flags |= MSFS_INLINE_DATA_FL;
+            msfs_inline_copy(inode, NULL, 0, msfs_inline_max(inode->i_sb), 1);
+            msfs_inline_copy(inode, kaddr, 0, size, 1);
+            up_write(&ei->i_data_sem);
+            kunmap(page);
+        }
+    }
+    unlock_page(page);
+    page_cache_release(page);
+    mark_inode_dirty(inode);
+    return err;
+}
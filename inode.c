@@ -1,35 +1,37 @@
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/smp.h>
+#include <linux/sched.h>
 #include "inode.h"
 
-static DEFINE_SPINLOCK(bitmap_lock);
-
 extern const struct inode_operations msfs_file_inode_operations;
 extern const struct inode_operations msfs_dir_inode_operations;
 extern const struct file_operations msfs_file_operations;
 extern const struct file_operations msfs_dir_operations;
 extern struct inode_operations msfs_symlink_inode_operations;
+extern struct inode_operations msfs_fast_symlink_inode_operations;
 extern struct address_space_operations msfs_aops;
 
 struct msfs_inode * msfs_raw_inode(struct super_block *sb, ino_t ino, struct buffer_head **bh)
 {
-	struct msfs_sb_info *ms_sb_info = msfs_sb(sb);
-	struct msfs_super_block *ms_sb = ms_sb_info->s_ms;
-	int ninodes = ms_sb->s_ninodes;
+	struct msfs_sb_info *sbi = msfs_sb(sb);
     struct msfs_inode *p;
-    int block;
+    unsigned long index;
 	
-    if (ino + 1 > ninodes || ino == 0) {
+    if (ino + 1 > sbi->s_inodes_count || ino == 0) {
         printk("msfs_raw_inode ino to bigger or reading 0 ino\n");
 		return NULL;
 	}
 	
-    block = 2 + ms_sb->s_imap_blocks + ms_sb->s_zmap_blocks + ino / MSFS_INODES_PER_BLOCK;
-	*bh = sb_bread(sb, block);
+    index = ino % sbi->s_inodes_per_group;
+	*bh = msfs_itable_get(sb, ino / sbi->s_inodes_per_group,
+			      index / sbi->s_inodes_per_block);
 	if (!*bh) {
 		printk("Unable to read inode block\n");
 		return NULL;
 	}
-	p = (void *)(*bh)->b_data;
-    return p + ino % MSFS_INODES_PER_BLOCK;
+	p = (void *)((*bh)->b_data + index % sbi->s_inodes_per_block * sbi->s_inode_size);
+    return p;
 }
 
 struct buffer_head * msfs_update_inode(struct inode * inode)
@@ -48,65 +50,422 @@ struct buffer_head * msfs_update_inode(struct inode * inode)
 
 	raw_inode->i_size = inode->i_size;
 	raw_inode->i_mtime = inode->i_mtime.tv_sec;
+	raw_inode->i_flags = msfs_inode->mfs_inode.i_flags;
 	if (S_ISCHR(inode->i_mode) || S_ISBLK(inode->i_mode))
 		raw_inode->r_dev = old_encode_dev(inode->i_rdev);
-	else for (i = 0; i < 10; i++)
-		raw_inode->i_zone[i] = msfs_inode->mfs_inode.i_zone[i];
+	else {
+		down_read(&msfs_inode->i_data_sem);
+		for (i = 0; i < 10; i++)
+			raw_inode->i_zone[i] = msfs_inode->mfs_inode.i_zone[i];
+		memcpy(raw_inode + 1, msfs_inode->i_tail,
+		       msfs_sb(inode->i_sb)->s_inode_size - sizeof(*raw_inode));
+		up_read(&msfs_inode->i_data_sem);
+	}
 	mark_buffer_dirty(bh);
     mark_inode_dirty(inode);
     return bh;
 }
 
 
-int msfs_new_block(struct super_block *sb)
+//bookkeeping for n bits just set in the block bitmap under gi->lock
+static void msfs_blocks_taken(struct msfs_sb_info *sbi, struct msfs_group_info *gi, int n)
 {
-    struct msfs_sb_info *sbi = msfs_sb(sb);
-    int bits_per_zone = MSFS_BLOCK_SIZE;
-    int i;
+    percpu_counter_sub(&sbi->s_freeblocks_counter, n);
+    mark_buffer_dirty(gi->block_bitmap);
+    mark_buffer_dirty(gi->desc_bh);
+}
 
-    for (i = 0; i < sbi->s_ms->s_zmap_blocks; i++) {
-        struct buffer_head *bh = sbi->s_zmap[i];
-        int j;
+/*
+ * Reservation windows: a regular file that allocates gets the free blocks
+ * behind the ones it took marked in its group's rsv_bitmap, and takes its
+ * next blocks from there. Reserved blocks are not in the free extent tree,
+ * other files only fall back to them when nothing else is free, so
+ * concurrent writers do not interleave. The window is [i_rsv_start,
+ * i_rsv_end) inside one group, it lives in memory only and is covered by
+ * i_data_sem.
+ */
+void msfs_discard_reservation(struct inode *inode)
+{
+    struct msfs_sb_info *sbi = msfs_sb(inode->i_sb);
+    struct msfs_inode_info *ei = msfs_i(inode);
+    struct msfs_group_info *gi;
+    unsigned long first, b;
+
+    if (ei->i_rsv_start < ei->i_rsv_end) {
+        first = msfs_group_first_block(sbi, msfs_block_group(sbi, ei->i_rsv_start));
+        gi = &sbi->s_groups[msfs_block_group(sbi, ei->i_rsv_start)];
+        spin_lock(&gi->lock);
+        for (b = ei->i_rsv_start - first; b < ei->i_rsv_end - first; b++) {
+            __clear_bit_le(b, gi->rsv_bitmap);
+            if (!test_bit_le(b, gi->block_bitmap->b_data))
+                msfs_fe_give(gi, b, 1);
+        }
+        spin_unlock(&gi->lock);
+    }
+    ei->i_rsv_start = ei->i_rsv_end = 0;
+}
 
-        spin_lock(&bitmap_lock);
-        j = msfs_find_first_zero_bit(bh->b_data, bits_per_zone);
+//take goal, or the next free blocks after it, out of the window of inode
+static unsigned long msfs_alloc_in_window(struct inode *inode, unsigned long goal,
+            unsigned int *count)
+{
+    struct msfs_sb_info *sbi = msfs_sb(inode->i_sb);
+    struct msfs_inode_info *ei = msfs_i(inode);
+    unsigned long group = msfs_block_group(sbi, ei->i_rsv_start);
+    unsigned long first = msfs_group_first_block(sbi, group);
+    struct msfs_group_info *gi = &sbi->s_groups[group];
+    void *bitmap = gi->block_bitmap->b_data;
+    int bit, b, n, end = ei->i_rsv_end - first;
+
+    if (goal < ei->i_rsv_start || goal >= ei->i_rsv_end)
+        goal = ei->i_rsv_start;
+
+    spin_lock(&gi->lock);
+    bit = find_next_zero_bit_le(bitmap, end, goal - first);
+    if (bit < end) {
+        //the window blocks in front of it are not coming back
+        for (b = ei->i_rsv_start - first; b < bit; b++) {
+            __clear_bit_le(b, gi->rsv_bitmap);
+            if (!test_bit_le(b, bitmap))
+                msfs_fe_give(gi, b, 1);
+        }
+        for (n = 0; n < *count && bit + n < end && !test_bit_le(bit + n, bitmap); n++) {
+            __clear_bit_le(bit + n, gi->rsv_bitmap);
+            msfs_set_bit(bit + n, bitmap);
+        }
+        gi->desc->bg_free_blocks_count -= n;
+        spin_unlock(&gi->lock);
+        msfs_blocks_taken(sbi, gi, n);
+        ei->i_rsv_start = first + bit + n;
+        *count = n;
+        return first + bit;
+    }
+    spin_unlock(&gi->lock);
+    //somebody short of space took the rest
+    msfs_discard_reservation(inode);
+    return 0;
+}
 
-        if (j < bits_per_zone && j >= 0) {
-            msfs_set_bit(j, bh->b_data);
-            spin_unlock(&bitmap_lock);
-            mark_buffer_dirty(bh);
-            j += i * bits_per_zone + sbi->s_ms->s_firstdatazone + 1;
-            if (j < sbi->s_ms->s_firstdatazone || j + 1 > sbi->s_ms->s_nzones)
-                break;
-            return j;
+/*
+ * Promise count blocks out of what is free, less those promised to delayed
+ * buffers and the MSFS_DA_SLACK their writeback needs for extent nodes.
+ * The blocks go into s_dirtyblocks_counter before the check, so claims
+ * racing with each other all see each other and back out rather than
+ * overcommit together. The caller subtracts them again once they are
+ * allocated or no longer needed.
+ */
+int msfs_claim_blocks(struct msfs_sb_info *sbi, unsigned int count)
+{
+    s64 slop = 4 * percpu_counter_batch * num_online_cpus(), free;
+
+    percpu_counter_add(&sbi->s_dirtyblocks_counter, count);
+    free = percpu_counter_read_positive(&sbi->s_freeblocks_counter) -
+        percpu_counter_read_positive(&sbi->s_dirtyblocks_counter);
+    //the per cpu counts may be off by a batch each, look closer near the limit
+    if (free < MSFS_DA_SLACK + slop)
+        free = percpu_counter_sum_positive(&sbi->s_freeblocks_counter) -
+            percpu_counter_sum(&sbi->s_dirtyblocks_counter);
+    if (free < MSFS_DA_SLACK) {
+        percpu_counter_sub(&sbi->s_dirtyblocks_counter, count);
+        return -ENOSPC;
+    }
+    return 0;
+}
+
+/*
+ * Take up to *count blocks in one run as close to goal as possible, the
+ * block after the previous one of the file for data. The free extent tree
+ * is asked for a run of all of them first, then for whatever run is
+ * nearest. A goal of 0 means anywhere near the inode and never opens a
+ * window, that is for metadata like extent nodes. Sets *count to the
+ * length of the run, returns its first block or 0 when the filesystem is
+ * full. Callers hold i_data_sem for write.
+ */
+static unsigned long msfs_alloc_blocks(struct inode *inode, unsigned long goal,
+            unsigned int *count)
+{
+    struct msfs_sb_info *sbi = msfs_sb(inode->i_sb);
+    struct msfs_inode_info *ei = msfs_i(inode);
+    int rsv = goal && S_ISREG(inode->i_mode);
+    unsigned int want = *count, n, w;
+    unsigned long group, first, i, block;
+    int bit, end, start, pass;
+
+    if (rsv && ei->i_rsv_end) {
+        if (ei->i_rsv_start < ei->i_rsv_end) {
+            block = msfs_alloc_in_window(inode, goal, count);
+            if (block)
+                return block;
+        } else if (ei->i_rsv_size < MSFS_RSV_MAX) {
+            //a used up window, the file is streaming so give it more
+            ei->i_rsv_size <<= 1;
+        }
+        msfs_discard_reservation(inode);
+    }
+
+    if (goal < sbi->s_first_data_block || goal >= sbi->s_blocks_count)
+        goal = msfs_group_first_block(sbi, inode->i_ino / sbi->s_inodes_per_group);
+
+    //a run of want, then any run, then blocks in the windows of others
+    for (pass = 0; pass < 3; pass++) {
+        group = msfs_block_group(sbi, goal);
+        start = goal - msfs_group_first_block(sbi, group);
+        //one more round so the goal group is also searched in front of goal
+        for (i = 0; i <= sbi->s_groups_count; i++) {
+            struct msfs_group_info *gi = &sbi->s_groups[group];
+            void *bitmap = gi->block_bitmap->b_data;
+
+            if (gi->desc->bg_free_blocks_count < (pass ? 1 : want))
+                goto next;
+
+            first = msfs_group_first_block(sbi, group);
+            end = msfs_group_blocks(sbi, group);
+            spin_lock(&gi->lock);
+            if (pass < 2) {
+                bit = msfs_fe_find(gi, start, pass ? 1 : want);
+                if (bit < 0)
+                    goto unlock;
+                n = min(msfs_fe_run(gi, bit), want);
+                //the free blocks behind the run become the new window
+                w = rsv ? min(msfs_fe_run(gi, bit) - n, ei->i_rsv_size) : 0;
+                msfs_fe_take(gi, bit, n + w);
+                if (w) {
+                    for (block = bit + n; block < bit + n + w; block++)
+                        __set_bit_le(block, gi->rsv_bitmap);
+                    ei->i_rsv_start = first + bit + n;
+                    ei->i_rsv_end = first + bit + n + w;
+                }
+            } else {
+                bit = find_next_zero_bit_le(bitmap, end, start);
+                if (bit >= end)
+                    goto unlock;
+                if (!test_bit_le(bit, gi->rsv_bitmap))
+                    msfs_fe_take(gi, bit, 1);
+                n = 1;
+            }
+            for (block = bit; block < bit + n; block++)
+                msfs_set_bit(block, bitmap);
+            gi->desc->bg_free_blocks_count -= n;
+            spin_unlock(&gi->lock);
+            msfs_blocks_taken(sbi, gi, n);
+            *count = n;
+            return first + bit;
+unlock:
+            spin_unlock(&gi->lock);
+next:
+            start = 0;
+            if (++group == sbi->s_groups_count)
+                group = 0;
         }
-        spin_unlock(&bitmap_lock);
     }
     return 0;
 }
 
-int msfs_free_block(struct super_block *sb, int block)
+//msfs_alloc_blocks, only writeback of delayed buffers draws on what they reserved
+unsigned long msfs_new_blocks(struct inode *inode, unsigned long goal, unsigned int *count)
+{
+    struct msfs_sb_info *sbi = msfs_sb(inode->i_sb);
+    unsigned int claimed = 0;
+    unsigned long block;
+
+    if (!msfs_i(inode)->i_da_writeback) {
+        claimed = *count;
+        if (msfs_claim_blocks(sbi, claimed)) {
+            //not the whole run, maybe a block
+            claimed = *count = 1;
+            if (msfs_claim_blocks(sbi, claimed))
+                return 0;
+        }
+    }
+    block = msfs_alloc_blocks(inode, goal, count);
+    //they are off the free count by now, or were not taken at all
+    if (claimed)
+        percpu_counter_sub(&sbi->s_dirtyblocks_counter, claimed);
+    return block;
+}
+
+int msfs_new_block(struct inode *inode, unsigned long goal)
+{
+    unsigned int count = 1;
+
+    return msfs_new_blocks(inode, goal, &count);
+}
+
+/*
+ * With -o discard a run about to be freed is discarded first, while it is
+ * still ours, so the discard cannot race with the block's next owner.
+ */
+static void msfs_discard_blocks(struct super_block *sb, int block, int count)
 {
     struct msfs_sb_info *sbi = msfs_sb(sb);
-    struct buffer_head *bh;
-    unsigned long bit, zone, zmap_block;
-    int ret = -ENODEV;
-    if (block < sbi->s_ms->s_firstdatazone || block >= sbi->s_ms->s_nzones) {
+    struct msfs_group_info *gi;
+    unsigned long group;
+
+    if (!(sbi->s_mount_opt & MSFS_MOUNT_DISCARD) || count <= 0)
+        return;
+    //a run never spans a group, anything odd is left to msfs_release_block to report
+    if (block < sbi->s_first_data_block || block + count > sbi->s_blocks_count)
+        return;
+    group = msfs_block_group(sbi, block);
+    gi = &sbi->s_groups[group];
+    if (msfs_block_group(sbi, block + count - 1) != group ||
+        block < gi->desc->bg_inode_table + sbi->s_itb_per_group)
+        return;
+    sb_issue_discard(sb, block, count, GFP_NOFS, 0);
+}
+
+static int msfs_release_block(struct super_block *sb, int block)
+{
+    struct msfs_sb_info *sbi = msfs_sb(sb);
+    struct msfs_group_info *gi;
+    unsigned long group, bit;
+    int was_set;
+
+    if (block < sbi->s_first_data_block || block >= sbi->s_blocks_count) {
         printk("Trying to free block not in datazone\n");
-        return ret;
+        return -ENODEV;
+    }
+    group = msfs_block_group(sbi, block);
+    gi = &sbi->s_groups[group];
+    if (block < gi->desc->bg_inode_table + sbi->s_itb_per_group) {
+        printk("Trying to free metadata block %d of group %lu\n", block, group);
+        return -ENODEV;
+    }
+    bit = block - msfs_group_first_block(sbi, group);
+
+    spin_lock(&gi->lock);
+    was_set = msfs_clear_bit(bit, gi->block_bitmap->b_data);
+    if (was_set) {
+        gi->desc->bg_free_blocks_count++;
+        //a block inside somebody's window goes back to the window only
+        if (!test_bit_le(bit, gi->rsv_bitmap))
+            msfs_fe_give(gi, bit, 1);
     }
-    zone = block - sbi->s_ms->s_firstdatazone;
+    spin_unlock(&gi->lock);
+    if (!was_set)
+        printk("msfs_free_block: block %d already free\n", block);
+    else
+        percpu_counter_inc(&sbi->s_freeblocks_counter);
+    mark_buffer_dirty(gi->block_bitmap);
+    mark_buffer_dirty(gi->desc_bh);
+    return 0;
+}
 
-    zmap_block = zone / MSFS_BLOCK_SIZE;
+int msfs_free_block(struct super_block *sb, int block)
+{
+    msfs_discard_blocks(sb, block, 1);
+    return msfs_release_block(sb, block);
+}
 
-    bit = zone - zmap_block * MSFS_BLOCK_SIZE - 1;
-    bh = sbi->s_zmap[zmap_block];
-    spin_lock(&bitmap_lock);
-    msfs_clear_bit(bit, bh->b_data);
-    spin_unlock(&bitmap_lock);
-    mark_buffer_dirty(bh);
-    return 0;
+//free a whole extent, with one discard for the run
+void msfs_free_blocks(struct super_block *sb, int block, int count)
+{
+    msfs_discard_blocks(sb, block, count);
+    while (count-- > 0)
+        msfs_release_block(sb, block++);
+}
+
+/*
+ * FITRIM of bits start..end of one group. Every free run of at least
+ * minlen blocks comes out of the free extent tree and is taken like an
+ * allocation, discarded and given back, so nobody can get it while the
+ * discard is in flight. Blocks inside reservation windows are skipped.
+ */
+static int msfs_trim_group(struct super_block *sb, unsigned long group,
+            unsigned long start, unsigned long end, unsigned long minlen,
+            unsigned long *trimmed)
+{
+    struct msfs_sb_info *sbi = msfs_sb(sb);
+    struct msfs_group_info *gi = &sbi->s_groups[group];
+    unsigned long first = msfs_group_first_block(sbi, group);
+    void *bitmap = gi->block_bitmap->b_data;
+    unsigned long next, i, n = 0;
+    int bit, err = 0;
+
+    spin_lock(&gi->lock);
+    while (start < end) {
+        bit = msfs_fe_find(gi, start, minlen);
+        if (bit < 0 || bit >= end)
+            break;
+        start = bit;
+        next = min(start + msfs_fe_run(gi, start), end);
+        if (next - start < minlen) {
+            start = next;
+            continue;
+        }
+        msfs_fe_take(gi, start, next - start);
+        for (i = start; i < next; i++)
+            msfs_set_bit(i, bitmap);
+        gi->desc->bg_free_blocks_count -= next - start;
+        spin_unlock(&gi->lock);
+        percpu_counter_sub(&sbi->s_freeblocks_counter, next - start);
+
+        err = sb_issue_discard(sb, first + start, next - start, GFP_NOFS, 0);
+        if (!err)
+            n += next - start;
+
+        percpu_counter_add(&sbi->s_freeblocks_counter, next - start);
+        spin_lock(&gi->lock);
+        for (i = start; i < next; i++)
+            msfs_clear_bit(i, bitmap);
+        gi->desc->bg_free_blocks_count += next - start;
+        msfs_fe_give(gi, start, next - start);
+        start = next;
+        if (err || fatal_signal_pending(current))
+            break;
+        if (need_resched()) {
+            spin_unlock(&gi->lock);
+            cond_resched();
+            spin_lock(&gi->lock);
+        }
+    }
+    spin_unlock(&gi->lock);
+    if (n) {
+        //the bitmap may have been written back in the window
+        mark_buffer_dirty(gi->block_bitmap);
+        mark_buffer_dirty(gi->desc_bh);
+    }
+    *trimmed += n;
+    return err;
+}
+
+/*
+ * Discard the free blocks of range, in bytes like struct fstrim_range. On
+ * return range->len holds how much was discarded.
+ */
+int msfs_trim_fs(struct super_block *sb, struct fstrim_range *range)
+{
+    struct msfs_sb_info *sbi = msfs_sb(sb);
+    int bits = sb->s_blocksize_bits;
+    u64 start = range->start >> bits, end = start + (range->len >> bits);
+    unsigned long minlen = range->minlen >> bits, trimmed = 0;
+    unsigned long group, first, gend;
+    int err = 0;
+
+    if (end < start || end > sbi->s_blocks_count)
+        end = sbi->s_blocks_count;
+    if (start < sbi->s_first_data_block)
+        start = sbi->s_first_data_block;
+    if (!minlen)
+        minlen = 1;
+    range->len = 0;
+    if (start >= end || minlen > sbi->s_blocks_per_group)
+        return 0;
+
+    for (group = msfs_block_group(sbi, start); group < sbi->s_groups_count; group++) {
+        first = msfs_group_first_block(sbi, group);
+        if (first >= end)
+            break;
+        gend = min_t(unsigned long, end - first, msfs_group_blocks(sbi, group));
+        err = msfs_trim_group(sb, group, start > first ? start - first : 0, gend,
+                    minlen, &trimmed);
+        if (err)
+            break;
+    }
+    range->len = (u64)trimmed << bits;
+    return err;
 }
+
 struct inode *msfs_iget(struct super_block *sb, unsigned long ino)
 {
     struct inode *inode;
@@ -138,57 +497,103 @@ struct inode *msfs_iget(struct super_block *sb, unsigned long ino)
     inode->i_blocks = 0;
     inode->i_ino = ino;
     msfs_info->mfs_inode =  *raw_inode;
+    memset(msfs_info->i_tail, 0, sizeof(msfs_info->i_tail));
+    memcpy(msfs_info->i_tail, raw_inode + 1,
+           msfs_sb(sb)->s_inode_size - sizeof(*raw_inode));
+    //a symlink target also needs its NUL inside
+    if (msfs_inline(inode) && ((!S_ISREG(inode->i_mode) && !S_ISLNK(inode->i_mode)) ||
+        inode->i_size + S_ISLNK(inode->i_mode) > msfs_inline_max(sb))) {
+        printk("msfs: bad inline inode %lu\n", ino);
+        brelse(bh);
+        iget_failed(inode);
+        return ERR_PTR(-EIO);
+    }
+    msfs_info->i_dx_hint = 0;
+    msfs_info->i_dx_retry = !(msfs_info->mfs_inode.i_flags & MSFS_INDEX_FL);
+    msfs_info->i_rsv_start = msfs_info->i_rsv_end = 0;
+    msfs_info->i_rsv_size = MSFS_RSV_MIN;
+    msfs_info->i_da_blocks = 0;
+    msfs_info->i_da_writeback = 0;
+    atomic_set(&msfs_info->i_unwritten, 0);
     msfs_set_inode(inode, old_decode_dev(raw_inode->r_dev));
     brelse(bh);
     unlock_new_inode(inode);
     return inode;
 }
 
-unsigned long msfs_count_free_blocks(struct super_block *sb)
+/*
+ * Count the clear bits among the first count bits of a map, the padding
+ * past count is kept set by mkfs but not trusted here.
+ */
+static unsigned long msfs_count_free(struct buffer_head **map, int blocks,
+            unsigned long count)
 {
-    struct msfs_sb_info *m_sbi = msfs_sb(sb);
-    int i = 0, j = 0, count = 0, blocks = 0;
-    char *p;
-    struct buffer_head *bh;
-    int all_blocks = m_sbi->s_ms->s_nzones - m_sbi->s_ms->s_firstdatazone - 1;
-    for (i = 0; i < m_sbi->s_ms->s_zmap_blocks; i++)
+    unsigned long bits, used, j, free = 0;
+    int i;
+
+    for (i = 0; i < blocks && count; i++)
     {
-        bh = m_sbi->s_zmap[i];
-        p = bh->b_data;
-        for (j = 0; j < MSFS_BLOCK_SIZE; j++)
-        {
-            blocks++;
-            if (blocks <= all_blocks)
-            {
-                if (p[j] == 0)
-                {
-                    count++;
-                }
-            }
-            else
-            {
-                break;
-            }
+        char *p = map[i]->b_data;
+
+        bits = min_t(unsigned long, count, MSFS_BITS_PER_BLOCK);
+        used = memweight(p, bits / 8);
+        for (j = bits & ~7UL; j < bits; j++)
+            used += test_bit_le(j, p);
+        free += bits - used;
+        count -= bits;
+    }
+    return free;
+}
+
+/*
+ * Walk the block bitmaps, only done at mount. A group descriptor that does
+ * not agree with its bitmap is corrected, the bitmap is what allocation trusts.
+ */
+unsigned long msfs_count_free_blocks(struct super_block *sb)
+{
+    struct msfs_sb_info *sbi = msfs_sb(sb);
+    unsigned long i, n, free = 0;
+
+    for (i = 0; i < sbi->s_groups_count; i++) {
+        struct msfs_group_info *gi = &sbi->s_groups[i];
+
+        n = msfs_count_free(&gi->block_bitmap, 1, msfs_group_blocks(sbi, i));
+        if (n != gi->desc->bg_free_blocks_count) {
+            printk("msfs: group %lu free blocks %u, bitmap says %lu\n", i,
+                    gi->desc->bg_free_blocks_count, n);
+            gi->desc->bg_free_blocks_count = n;
+            if (!(sb->s_flags & MS_RDONLY))
+                mark_buffer_dirty(gi->desc_bh);
         }
+        free += n;
     }
-    return count;
+    return free;
 }
 
-//frree inode data block
+//free the data blocks past i_size
 int msfs_truncate(struct inode *inode)
 {
     struct msfs_inode_info *ms_info = msfs_i(inode);
-    struct msfs_sb_info *m_sb = msfs_sb(inode->i_sb);
-    int i = 0;
-    for(i = 0; i < 10; i++)
-    {
-        if (ms_info->mfs_inode.i_zone[i] > m_sb->s_ms->s_firstdatazone)
-        {
-            msfs_free_block(inode->i_sb, ms_info->mfs_inode.i_zone[i]);
-            ms_info->mfs_inode.i_zone[i] = 0;
-        }
+    sector_t start = 0;
+    int err;
+
+    if (msfs_inline(inode)) {
+        msfs_inline_truncate(inode);
+        inode->i_mtime = inode->i_ctime = inode->i_atime = CURRENT_TIME_SEC;
+        return 0;
     }
 
+    //a directory keeps its index blocks past i_size until it is deleted
+    if (!S_ISDIR(inode->i_mode))
+        start = (inode->i_size + inode->i_sb->s_blocksize - 1) >> inode->i_blkbits;
+
+    down_write(&ms_info->i_data_sem);
+    msfs_discard_reservation(inode);
+    err = msfs_ext_truncate(inode, start);
+    up_write(&ms_info->i_data_sem);
+    if (err)
+        return err;
+
     inode->i_mtime = inode->i_ctime = inode->i_atime = CURRENT_TIME_SEC;
     mark_inode_dirty(inode);
     return 0;
@@ -198,85 +603,105 @@ int msfs_truncate(struct inode *inode)
 int msfs_free_inode(struct inode *inode)
 {
     struct msfs_sb_info *sbi = msfs_sb(inode->i_sb);
-    struct buffer_head *bh;
-    unsigned long ino, bit, map_block;
+    struct msfs_group_info *gi;
+    unsigned long ino, bit;
+    int was_set;
 
     ino = inode->i_ino;
-    if (ino < 2 || ino + 1 > sbi->s_ms->s_ninodes) {
+    if (ino < 2 || ino + 1 > sbi->s_inodes_count) {
         printk("msfs_free_inode: inode 1 or nonexistent inode\n");
         return -ENODEV;
     }
 
-    map_block = (ino) / MSFS_BLOCK_SIZE;
-    if (map_block + 1 > sbi->s_ms->s_imap_blocks) {
-        printk("msfs_free_inode: nonexistent imap in superblock %ld %d\n", ino, sbi->s_ms->s_imap_blocks);
-        return -ENODEV;
-    }
-
     msfs_clear_inode(inode);	/* clear on-disk copy */
 
-    bh = sbi->s_imap[map_block];
-    spin_lock(&bitmap_lock);
-    bit = ino - map_block * MSFS_BLOCK_SIZE;
-    msfs_clear_bit(bit, bh->b_data);
-    spin_unlock(&bitmap_lock);
-    mark_buffer_dirty(bh);
+    gi = &sbi->s_groups[ino / sbi->s_inodes_per_group];
+    bit = ino % sbi->s_inodes_per_group;
+    spin_lock(&gi->lock);
+    was_set = msfs_clear_bit(bit, gi->inode_bitmap->b_data);
+    if (was_set)
+        gi->desc->bg_free_inodes_count++;
+    spin_unlock(&gi->lock);
+    if (!was_set)
+        printk("msfs_free_inode: inode %lu already free\n", ino);
+    else
+        percpu_counter_inc(&sbi->s_freeinodes_counter);
+    mark_buffer_dirty(gi->inode_bitmap);
+    mark_buffer_dirty(gi->desc_bh);
     return 0;
 }
 
+/*
+ * Directories are spread by the allocating cpu so parallel mkdir work
+ * lands in different groups, files go next to their parent directory.
+ */
 struct inode *msfs_new_inode(const struct inode *dir, umode_t mode, int *error)
 {
     struct super_block *sb = dir->i_sb;
     struct msfs_sb_info *sbi = msfs_sb(sb);
     struct inode *inode = new_inode(sb);
-    struct buffer_head * bh;
-    int bits_per_zone = MSFS_BLOCK_SIZE;
-    unsigned long j;
-    int i;
+    struct msfs_group_info *gi;
+    unsigned long group, i;
+    int j = -ENODEV;
 
     if (!inode) {
         *error = -ENOMEM;
         return NULL;
     }
 
-    j = bits_per_zone;
-    bh = NULL;
+    if (S_ISDIR(mode))
+        group = raw_smp_processor_id() % sbi->s_groups_count;
+    else
+        group = dir->i_ino / sbi->s_inodes_per_group;
+
     *error = -ENOSPC;
-    spin_lock(&bitmap_lock);
-    for (i = 0; i < sbi->s_ms->s_imap_blocks; i++) {
-        bh = sbi->s_imap[i];
-        j = msfs_find_first_zero_bit(bh->b_data, bits_per_zone);
-        if (j < bits_per_zone)
-            break;
+    for (i = 0; i < sbi->s_groups_count; i++) {
+        gi = &sbi->s_groups[group];
+        if (gi->desc->bg_free_inodes_count) {
+            spin_lock(&gi->lock);
+            j = msfs_find_first_zero_bit(gi->inode_bitmap->b_data,
+                    sbi->s_inodes_per_group);
+            if (j >= 0) {
+                msfs_set_bit(j, gi->inode_bitmap->b_data);
+                gi->desc->bg_free_inodes_count--;
+                spin_unlock(&gi->lock);
+                break;
+            }
+            spin_unlock(&gi->lock);
+        }
+        if (++group == sbi->s_groups_count)
+            group = 0;
     }
 
-    if (!bh || j >= bits_per_zone) {
+    if (j < 0) {
         printk("Not any more inode for using\n");
-        spin_unlock(&bitmap_lock);
-        iput(inode);
-        return NULL;
-    }
-
-    msfs_set_bit(j, bh->b_data);
-
-    spin_unlock(&bitmap_lock);
-
-    j += i * bits_per_zone;
-    if (j <= 0 || j + 1 > sbi->s_ms->s_ninodes) {
         iput(inode);
         return NULL;
     }
-    mark_buffer_dirty(bh);
+    percpu_counter_dec(&sbi->s_freeinodes_counter);
+    mark_buffer_dirty(gi->inode_bitmap);
+    mark_buffer_dirty(gi->desc_bh);
 
     inode_init_owner(inode, dir, mode);
-    inode->i_ino = j;
+    inode->i_ino = group * sbi->s_inodes_per_group + j;
 
     inode->i_mtime = inode->i_atime = inode->i_ctime = CURRENT_TIME_SEC;
     inode->i_blocks = 0;
-    for(i = 0; i < 10; i++)
-    {
-        msfs_i(inode)->mfs_inode.i_zone[i] = 0;
-    }
+    msfs_i(inode)->mfs_inode.i_flags = 0;
+    msfs_i(inode)->i_dx_hint = 0;
+    msfs_i(inode)->i_dx_retry = 0;
+    msfs_i(inode)->i_rsv_start = msfs_i(inode)->i_rsv_end = 0;
+    msfs_i(inode)->i_rsv_size = MSFS_RSV_MIN;
+    msfs_i(inode)->i_da_blocks = 0;
+    msfs_i(inode)->i_da_writeback = 0;
+    atomic_set(&msfs_i(inode)->i_unwritten, 0);
+    memset(msfs_i(inode)->i_tail, 0, sizeof(msfs_i(inode)->i_tail));
+    //a new file starts inside its inode
+    if (S_ISREG(mode) && msfs_inline_max(sb)) {
+        memset(msfs_i(inode)->mfs_inode.i_zone, 0, sizeof(msfs_i(inode)->mfs_inode.i_zone));
+        msfs_i(inode)->mfs_inode.i_flags = MSFS_INLINE_DATA_FL;
+    } else
+        msfs_ext_tree_init(inode);
     insert_inode_hash(inode);
     mark_inode_dirty(inode);
     *error = 0;
@@ -293,7 +718,7 @@ int msfs_clear_inode(struct inode *inode)
     if (raw_inode) {
         raw_inode->i_nlinks = 0;
         raw_inode->i_mode = 0;
-        memset(raw_inode, 0, sizeof (struct msfs_inode));
+        memset(raw_inode, 0, msfs_sb(inode->i_sb)->s_inode_size);
     }
     if (bh) {
         mark_buffer_dirty(bh);
@@ -313,6 +738,8 @@ void msfs_set_inode(struct inode *inode, dev_t rdev)
         inode->i_op = &msfs_dir_inode_operations;
         inode->i_fop = &msfs_dir_operations;
         inode->i_mapping->a_ops = &msfs_aops;
+    } else if (S_ISLNK(inode->i_mode) && msfs_inline(inode)) {
+        inode->i_op = &msfs_fast_symlink_inode_operations;
     } else if (S_ISLNK(inode->i_mode)) {
         inode->i_op = &msfs_symlink_inode_operations;
         inode->i_mapping->a_ops = &msfs_aops;
@@ -322,170 +749,235 @@ void msfs_set_inode(struct inode *inode, dev_t rdev)
 
 unsigned long msfs_count_free_inodes(struct super_block *sb)
 {
-    struct msfs_sb_info *m_sbi = msfs_sb(sb);
-    int i = 0, j = 0, count = 0, inodes = 0;
-    char *p;
-    struct buffer_head *bh;
-    int all_inodes = m_sbi->s_ms->s_ninodes;
-    for (i = 0; i < m_sbi->s_ms->s_imap_blocks; i++)
-    {
-        bh = m_sbi->s_imap[i];
-        p = bh->b_data;
-        for (j = 0; j < MSFS_BLOCK_SIZE; j++)
-        {
-            inodes++;
-            if (inodes <= all_inodes) {
-                if (p[j] == 0) {
-                    count++;
-                }
-            } else {
-                break;
-            }
+    struct msfs_sb_info *sbi = msfs_sb(sb);
+    unsigned long i, n, free = 0;
+
+    for (i = 0; i < sbi->s_groups_count; i++) {
+        struct msfs_group_info *gi = &sbi->s_groups[i];
+
+        n = msfs_count_free(&gi->inode_bitmap, 1, sbi->s_inodes_per_group);
+        if (n != gi->desc->bg_free_inodes_count) {
+            printk("msfs: group %lu free inodes %u, bitmap says %lu\n", i,
+                    gi->desc->bg_free_inodes_count, n);
+            gi->desc->bg_free_inodes_count = n;
+            if (!(sb->s_flags & MS_RDONLY))
+                mark_buffer_dirty(gi->desc_bh);
         }
+        free += n;
     }
-    return count;
+    return free;
 }
 
 ino_t msfs_inode_by_name(struct dentry *dentry)
 {
     struct buffer_head *bh;
-    struct msfs_dir_entry *de = msfs_find_entry(dentry, &bh);
+    struct msfs_dir_entry *de;
+    ino_t ino;
+
+    //a hot lookup is answered from the name cache without any buffer
+    switch (msfs_nc_find(dentry->d_parent->d_inode, dentry->d_name.name,
+                dentry->d_name.len, &ino, NULL, NULL)) {
+    case 1:
+        return ino;
+    case 0:
+        return 0;
+    }
+
+    de = msfs_find_entry(dentry, &bh);
     if (de)
     {
-        return de->inode;
+        ino = de->inode;
+        brelse(bh);
+        return ino;
     }
     return 0;
 
 }
 
+//a record must hold its name and stay inside the block
+int msfs_entry_ok(struct buffer_head *bh, struct msfs_dir_entry *de)
+{
+    unsigned long offset = (char *)de - bh->b_data;
+
+    if (de->rec_len < MSFS_DIR_REC_LEN(1) || de->rec_len % 4 ||
+        de->rec_len < MSFS_DIR_REC_LEN(de->name_len) ||
+        offset + de->rec_len > MSFS_BLOCK_SIZE) {
+        printk("msfs: bad directory entry in block %llu offset %lu\n",
+                (unsigned long long)bh->b_blocknr, offset);
+        return 0;
+    }
+    return 1;
+}
+
+void msfs_set_de_type(struct msfs_dir_entry *de, struct inode *inode)
+{
+    switch (inode->i_mode & S_IFMT) {
+    case S_IFREG:
+        de->file_type = MSFS_FT_REG_FILE;
+        break;
+    case S_IFDIR:
+        de->file_type = MSFS_FT_DIR;
+        break;
+    case S_IFCHR:
+        de->file_type = MSFS_FT_CHRDEV;
+        break;
+    case S_IFBLK:
+        de->file_type = MSFS_FT_BLKDEV;
+        break;
+    case S_IFIFO:
+        de->file_type = MSFS_FT_FIFO;
+        break;
+    case S_IFSOCK:
+        de->file_type = MSFS_FT_SOCK;
+        break;
+    case S_IFLNK:
+        de->file_type = MSFS_FT_SYMLINK;
+        break;
+    default:
+        de->file_type = MSFS_FT_UNKNOWN;
+    }
+}
+
+unsigned char msfs_dt_type(struct msfs_dir_entry *de)
+{
+    static const unsigned char dt[MSFS_FT_MAX] = {
+        DT_UNKNOWN, DT_REG, DT_DIR, DT_CHR, DT_BLK, DT_FIFO, DT_SOCK, DT_LNK,
+    };
+
+    return de->file_type < MSFS_FT_MAX ? dt[de->file_type] : DT_UNKNOWN;
+}
+
+struct msfs_dir_entry *msfs_search_block(struct buffer_head *bh, const char *name, int len)
+{
+    struct msfs_dir_entry *de = (struct msfs_dir_entry *)bh->b_data;
+    char *limit = bh->b_data + MSFS_BLOCK_SIZE;
+
+    for (; (char *)de < limit; de = msfs_next_entry(de))
+    {
+        if (!msfs_entry_ok(bh, de))
+            break;
+        if (de->inode && de->name_len == len && !memcmp(de->name, name, len))
+            return de;
+    }
+    return NULL;
+}
+
 struct msfs_dir_entry *msfs_find_entry(struct dentry *dentry, struct buffer_head **bh)
 {
     const unsigned char * name = dentry->d_name.name;
+    int namelen = dentry->d_name.len;
     struct inode * dir = dentry->d_parent->d_inode;
     struct super_block * sb = dir->i_sb;
-    struct buffer_head *bh_res, *bh_block;
-    struct msfs_dir_entry *de, *p_de;
-    __u32 inumber, i = 0, j = 0, dir_size = sizeof(struct msfs_dir_entry);
-    struct msfs_inode *raw_inode = msfs_raw_inode(sb, dir->i_ino, &bh_res);
-    struct msfs_inode_info *si = msfs_i(dentry->d_parent->d_inode);
-
-    if (!raw_inode)
+    struct buffer_head *bh_block;
+    struct msfs_dir_entry *de;
+    __u32 i = 0;
+    __u32 nblocks = dir->i_size / MSFS_BLOCK_SIZE;
+    sector_t block;
+    unsigned int offset;
+    ino_t ino;
+
+    switch (msfs_nc_find(dir, name, namelen, &ino, &block, &offset))
     {
+    case 0:
         return NULL;
-    }
-    for (i = 0 ; i < 10; i++)
-    {
-        if (si->mfs_inode.i_zone[i])
+    case 1:
+        bh_block = sb_bread(sb, block);
+        if (bh_block)
         {
-            bh_block = sb_bread(sb, si->mfs_inode.i_zone[i]);
-            de = (struct msfs_dir_entry *)bh_block->b_data;
-            inumber = MSFS_BLOCK_SIZE / dir_size;
-
-            for (j = 0; j < inumber; j++)
+            de = (struct msfs_dir_entry *)(bh_block->b_data + offset);
+            if (msfs_entry_ok(bh_block, de) && de->inode == ino &&
+                de->name_len == namelen && !memcmp(de->name, name, namelen))
             {
-                p_de = de + j;
-                if (!strcmp(name, p_de->name))
-                {
-                    *bh = bh_block;
-                    return p_de;
-                }
+                *bh = bh_block;
+                return de;
             }
+            brelse(bh_block);
         }
+        //the cache does not match the disk, stop trusting it
+        msfs_nc_drop(dir);
     }
-    return NULL;
 
-}
-
-int msfs_delete_entry(struct msfs_dir_entry *de, struct buffer_head *bh)
-{
-    struct msfs_dir_entry *de_p = (struct msfs_dir_entry *)bh->b_data;
-    __u32 inumber, i = 0, dir_size = sizeof(struct msfs_dir_entry);
-    if (!de || !bh)
+    if (msfs_dx_indexed(dir))
     {
-        return -EIO;
+        de = msfs_dx_find(dir, name, namelen, bh);
+        if (!IS_ERR(de))
+            return de;
     }
 
-    inumber = MSFS_BLOCK_SIZE / dir_size;
-
-
-    for (i =0 ; i < inumber; i++)
+    msfs_dir_readahead(dir, 0, nblocks);
+    for (i = 0 ; i < nblocks; i++)
     {
-        if (strcmp(de->name, de_p->name) == 0)
+        bh_block = msfs_bread(dir, i, 0);
+        if (!bh_block)
+            continue;
+        de = msfs_search_block(bh_block, name, namelen);
+        if (de)
         {
-            de_p->inode = 0;
-            memset(de_p->name, 0, MSFS_FILENAME_MAX_LEN);
-            mark_buffer_dirty(bh);
-            return 0;
+            *bh = bh_block;
+            return de;
         }
-        de_p++;
+        brelse(bh_block);
     }
-    return -EIO;
-}
-
+    return NULL;
 
-struct page * dir_get_page(struct inode *dir, unsigned long n)
-{
-    struct address_space *mapping = dir->i_mapping;
-    struct page *page = read_mapping_page(mapping, n, NULL);
-    if (!IS_ERR(page))
-        kmap(page);
-    return page;
 }
 
-void dir_put_page(struct page *page)
+//merge the entry into the one in front of it, or clear it at the start of a block
+int msfs_delete_entry(struct inode *dir, struct msfs_dir_entry *de, struct buffer_head *bh)
 {
-    kunmap(page);
-    page_cache_release(page);
-}
+    struct msfs_dir_entry *de_p = (struct msfs_dir_entry *)bh->b_data, *prev = NULL;
 
-#if 0
-inline int msfs_find_first_zero_bit(const void *vaddr, unsigned size)
-{
-    const unsigned short *p = vaddr, *addr = vaddr;
-    unsigned short num;
-
-    if (!size)
-        return 0;
+    if (!de || !bh)
+    {
+        return -EIO;
+    }
 
-    size >>= 4;
-    while (*p++ == 0xffff) {
-        if (--size == 0)
-            return (p - addr) << 4;
+    while (de_p < de)
+    {
+        if (!msfs_entry_ok(bh, de_p))
+            return -EIO;
+        prev = de_p;
+        de_p = msfs_next_entry(de_p);
     }
+    if (de_p != de)
+        return -EIO;
 
-    num = *--p;
-    return ((p - addr) << 4) + ffz(num);
+    if (msfs_dx_indexed(dir))
+        msfs_dx_remove(dir, de->name, de->name_len, bh->b_blocknr);
+    msfs_nc_remove(dir, de->name, de->name_len);
+    msfs_i(dir)->i_dx_hint = bh->b_blocknr;
+    if (prev)
+        prev->rec_len += de->rec_len;
+    else
+        de->inode = 0;
+    mark_buffer_dirty(bh);
+    return 0;
 }
-#endif
 
-inline int msfs_find_first_zero_bit(const void *vaddr, unsigned int size)
+
+/*
+ * imap and zmap are little endian bit arrays. find_next_zero_bit_le steps
+ * over full words a long at a time and ffz()s the first one with a hole.
+ */
+int msfs_find_first_zero_bit(const void *vaddr, unsigned int size)
 {
-    const char *p = vaddr;
-    int ret = -ENODEV;
-    unsigned int i = 0;
+    unsigned long bit;
 
     if (!size || vaddr == NULL)
-        return ret;
+        return -ENODEV;
 
-    for(i = 0; i < size; i++)
-    {
-        if (p[i] == 0)
-        {
-            ret = i;
-            break;
-        }
-    }
-    return ret;
+    bit = find_next_zero_bit_le(vaddr, size, 0);
+    if (bit >= size)
+        return -ENODEV;
+    return bit;
 }
 
 void msfs_set_bit(int nr, void *addr)
 {
-    char *p = addr;
-    p[nr] = 1;
+    __set_bit_le(nr, addr);
 }
 
-void msfs_clear_bit(int nr, void *addr)
+int msfs_clear_bit(int nr, void *addr)
 {
-    char *p = addr;
-    p[nr] = 0;
+    return __test_and_clear_bit_le(nr, addr);
 }
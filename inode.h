@@ -6,8 +6,13 @@
 struct buffer_head *msfs_update_inode(struct inode * inode);
 struct msfs_inode * msfs_raw_inode(struct super_block *sb, ino_t ino, struct buffer_head **bh);
 
-int msfs_new_block(struct super_block *sb);
+int msfs_claim_blocks(struct msfs_sb_info *sbi, unsigned int count);
+int msfs_new_block(struct inode *inode, unsigned long goal);
+unsigned long msfs_new_blocks(struct inode *inode, unsigned long goal, unsigned int *count);
+void msfs_discard_reservation(struct inode *inode);
 int msfs_free_block(struct super_block *sb, int block);
+void msfs_free_blocks(struct super_block *sb, int block, int count);
+int msfs_trim_fs(struct super_block *sb, struct fstrim_range *range);
 unsigned long msfs_count_free_blocks(struct super_block *sb);
 
 struct inode *msfs_iget(struct super_block *sb, unsigned long ino);
@@ -22,14 +27,71 @@ unsigned long msfs_count_free_inodes(struct super_block *sb);
 
 ino_t msfs_inode_by_name(struct dentry *dentry);
 struct msfs_dir_entry *msfs_find_entry(struct dentry *dentry, struct buffer_head **bh);
-int msfs_delete_entry(struct msfs_dir_entry *de, struct buffer_head *bh);
+int msfs_entry_ok(struct buffer_head *bh, struct msfs_dir_entry *de);
+void msfs_set_de_type(struct msfs_dir_entry *de, struct inode *inode);
+unsigned char msfs_dt_type(struct msfs_dir_entry *de);
+struct msfs_dir_entry *msfs_search_block(struct buffer_head *bh, const char *name, int len);
+int msfs_delete_entry(struct inode *dir, struct msfs_dir_entry *de, struct buffer_head *bh);
 
-struct page * dir_get_page(struct inode *dir, unsigned long n);
-void dir_put_page(struct page *page);
+void msfs_dir_readahead(struct inode *dir, sector_t start, unsigned long count);
+
+void msfs_ext_tree_init(struct inode *inode);
+int msfs_ext_map(struct inode *inode, sector_t block, unsigned int max_blocks,
+            sector_t *phys, unsigned int *flags);
+int msfs_ext_hole(struct inode *inode, sector_t block, unsigned int max_blocks);
+int msfs_ext_blocks(struct inode *inode, blkcnt_t *count);
+int msfs_ext_insert(struct inode *inode, sector_t block, sector_t phys,
+            unsigned int len, unsigned int flags);
+int msfs_ext_convert(struct inode *inode, sector_t block, unsigned int len);
+int msfs_ext_punch(struct inode *inode, sector_t start, sector_t end);
+int msfs_ext_truncate(struct inode *inode, sector_t start);
+
+int msfs_dx_indexed(struct inode *dir);
+void msfs_dx_create(struct inode *dir);
+struct msfs_dir_entry *msfs_dx_find(struct inode *dir, const char *name, int len,
+            struct buffer_head **res);
+void msfs_dx_add(struct inode *dir, const char *name, int len, sector_t block);
+void msfs_dx_remove(struct inode *dir, const char *name, int len, sector_t block);
+
+int msfs_nc_find(struct inode *dir, const char *name, int len, ino_t *ino,
+            sector_t *block, unsigned int *offset);
+void msfs_nc_add(struct inode *dir, const char *name, int len, ino_t ino,
+            sector_t block, unsigned int offset);
+void msfs_nc_remove(struct inode *dir, const char *name, int len);
+void msfs_nc_drop(struct inode *dir);
+void msfs_nc_init(void);
+void msfs_nc_exit(void);
+
+int msfs_fe_find(struct msfs_group_info *gi, unsigned int goal, unsigned int len);
+unsigned int msfs_fe_run(struct msfs_group_info *gi, unsigned int bit);
+void msfs_fe_take(struct msfs_group_info *gi, unsigned int start, unsigned int len);
+void msfs_fe_give(struct msfs_group_info *gi, unsigned int start, unsigned int len);
+int msfs_fe_build(struct msfs_group_info *gi, unsigned int blocks);
+void msfs_fe_destroy(struct msfs_group_info *gi);
+int msfs_fe_init(void);
+void msfs_fe_exit(void);
+
+struct buffer_head *msfs_itable_get(struct super_block *sb, unsigned long group,
+            unsigned long index);
+int msfs_itable_init(struct super_block *sb);
+void msfs_itable_destroy(struct msfs_sb_info *sbi);
+
+struct buffer_head *msfs_bread(struct inode *inode, sector_t block, int create);
+int msfs_da_get_block(struct inode *inode, sector_t block,
+            struct buffer_head *bh_result, int create);
+
+int msfs_inline_readpage(struct page *page);
+int msfs_inline_writepage(struct page *page);
+int msfs_inline_write_begin(struct address_space *mapping, unsigned flags,
+            struct page **pagep);
+int msfs_inline_write_end(struct inode *inode, loff_t pos, unsigned copied,
+            struct page *page);
+void msfs_inline_truncate(struct inode *inode);
+int msfs_inline_spill(struct inode *inode);
 
 int msfs_find_first_zero_bit(const void *vaddr, unsigned int size);
 void msfs_set_bit(int nr, void *addr);
-void msfs_clear_bit(int nr, void *addr);
+int msfs_clear_bit(int nr, void *addr);
 
 
 #endif
@@ -0,0 +1,156 @@
+#include <linux/slab.h>
+#include "inode.h"
+
+/*
+ * Inode table blocks for msfs_raw_inode. A small table is read whole at
+ * mount and its buffers stay pinned until umount, like the bitmaps, so a
+ * lookup is one array index. A big one keeps the MSFS_ITC_PER_GROUP blocks
+ * of each group used last on an LRU of that group under its own lock, so
+ * inodes of different groups never meet on a lock, just as the allocator
+ * keeps them apart. A miss reads the block and pushes out the oldest of
+ * its group. Either way the buffer handed out carries its own reference
+ * for the caller to brelse.
+ */
+
+#define MSFS_ITABLE_PIN_MAX 2048 //table blocks pinned at mount, 2M
+#define MSFS_ITC_PER_GROUP 8
+
+struct msfs_itc_entry {
+    struct list_head lru;
+    struct buffer_head *bh; //NULL until first used
+};
+
+//the cache of one group
+struct msfs_itc {
+    spinlock_t lock; //protects lru and the entries
+    struct list_head lru;
+    struct msfs_itc_entry entries[MSFS_ITC_PER_GROUP];
+};
+
+struct msfs_itable {
+    struct buffer_head **pinned; //every table block group by group, NULL for the LRUs
+    struct msfs_itc *groups; //one LRU per group, NULL when pinned
+};
+
+static struct msfs_itc_entry *msfs_itc_lookup(struct msfs_itc *c, sector_t block)
+{
+    struct msfs_itc_entry *e;
+
+    list_for_each_entry(e, &c->lru, lru) {
+        if (e->bh && e->bh->b_blocknr == block)
+            return e;
+    }
+    return NULL;
+}
+
+//table block index of group, the caller brelses it
+struct buffer_head *msfs_itable_get(struct super_block *sb, unsigned long group,
+            unsigned long index)
+{
+    struct msfs_sb_info *sbi = msfs_sb(sb);
+    struct msfs_itable *it = sbi->s_itable;
+    sector_t block = sbi->s_groups[group].desc->bg_inode_table + index;
+    struct buffer_head *bh, *old = NULL;
+    struct msfs_itc_entry *e;
+    struct msfs_itc *c;
+
+    if (it->pinned) {
+        bh = it->pinned[group * sbi->s_itb_per_group + index];
+        get_bh(bh);
+        return bh;
+    }
+
+    c = &it->groups[group];
+    spin_lock(&c->lock);
+    e = msfs_itc_lookup(c, block);
+    if (e) {
+        list_move(&e->lru, &c->lru);
+        bh = e->bh;
+        get_bh(bh);
+        spin_unlock(&c->lock);
+        return bh;
+    }
+    spin_unlock(&c->lock);
+
+    bh = sb_bread(sb, block);
+    if (!bh)
+        return NULL;
+
+    spin_lock(&c->lock);
+    //somebody may have read it meanwhile, then ours just goes back
+    e = msfs_itc_lookup(c, block);
+    if (!e) {
+        e = list_entry(c->lru.prev, struct msfs_itc_entry, lru);
+        old = e->bh;
+        e->bh = bh;
+        get_bh(bh);
+    }
+    list_move(&e->lru, &c->lru);
+    spin_unlock(&c->lock);
+    brelse(old);
+    return bh;
+}
+
+int msfs_itable_init(struct super_block *sb)
+{
+    struct msfs_sb_info *sbi = msfs_sb(sb);
+    unsigned long blocks = sbi->s_groups_count * sbi->s_itb_per_group, g, i, n;
+    struct msfs_itable *it;
+    struct msfs_itc *c;
+
+    it = kzalloc(sizeof(*it), GFP_KERNEL);
+    if (!it)
+        return -ENOMEM;
+    sbi->s_itable = it;
+    if (blocks > MSFS_ITABLE_PIN_MAX) {
+        it->groups = kzalloc(sbi->s_groups_count * sizeof(struct msfs_itc), GFP_KERNEL);
+        if (!it->groups)
+            return -ENOMEM;
+        for (g = 0; g < sbi->s_groups_count; g++) {
+            c = &it->groups[g];
+            spin_lock_init(&c->lock);
+            INIT_LIST_HEAD(&c->lru);
+            for (i = 0; i < MSFS_ITC_PER_GROUP; i++)
+                list_add_tail(&c->entries[i].lru, &c->lru);
+        }
+        return 0;
+    }
+
+    it->pinned = kcalloc(blocks, sizeof(struct buffer_head *), GFP_KERNEL);
+    if (!it->pinned)
+        return -ENOMEM;
+    for (g = 0; g < sbi->s_groups_count; g++) {
+        for (i = 0; i < sbi->s_itb_per_group; i++) {
+            n = g * sbi->s_itb_per_group + i;
+            it->pinned[n] = sb_bread(sb, sbi->s_groups[g].desc->bg_inode_table + i);
+            if (!it->pinned[n]) {
+                printk("msfs: unable to read inode table of group %lu on %s\n", g, sb->s_id);
+                return -EIO;
+            }
+        }
+    }
+    return 0;
+}
+
+void msfs_itable_destroy(struct msfs_sb_info *sbi)
+{
+    struct msfs_itable *it = sbi->s_itable;
+    unsigned long g, i;
+
+    if (!it)
+        return;
+    if (it->pinned) {
+        for (i = 0; i < sbi->s_groups_count * sbi->s_itb_per_group; i++)
+            brelse(it->pinned[i]);
+        kfree(it->pinned);
+    }
+    if (it->groups) {
+        for (g = 0; g < sbi->s_groups_count; g++) {
+            for (i = 0; i < MSFS_ITC_PER_GROUP; i++)
+                brelse(it->groups[g].entries[i].bh);
+        }
+        kfree(it->groups);
+    }
+    kfree(it);
+    sbi->s_itable = NULL;
+}
@@ -4,48 +4,96 @@
 #include <linux/types.h>
 #include <linux/magic.h>
 
-#define MSFS_FILENAME_MAX_LEN 50
+#define MSFS_FILENAME_MAX_LEN 255
 #define MSFS_BLOCK_SIZE 1024
+#define MSFS_BITS_PER_BLOCK (MSFS_BLOCK_SIZE * 8)
 #define MSFS_MAGIG 2020
 #define MSFS_ROOT_INO 1
 
+/*
+ * s_feature_incompat bits, a kernel must understand every bit that is set
+ * before it may mount the image.
+ */
+#define MSFS_FEATURE_INCOMPAT_EXTENTS 0x0001 //i_zone[] holds an extent tree root
+#define MSFS_FEATURE_INCOMPAT_BITMAP 0x0002 //imap and zmap use one bit per object
+#define MSFS_FEATURE_INCOMPAT_GROUPS 0x0004 //block groups, see the layout below
+#define MSFS_FEATURE_INCOMPAT_DIR_INDEX 0x0008 //directories may carry a hash index
+#define MSFS_FEATURE_INCOMPAT_DIRENT 0x0010 //variable length msfs_dir_entry with file type
+#define MSFS_FEATURE_INCOMPAT_UNWRITTEN 0x0020 //extents may be preallocated, see MSFS_EXT_UNWRITTEN
+#define MSFS_FEATURE_INCOMPAT_INLINE_DATA 0x0040 //s_inode_size inodes, small files live inside them
+#define MSFS_FEATURE_INCOMPAT_REQ (MSFS_FEATURE_INCOMPAT_EXTENTS | \
+		MSFS_FEATURE_INCOMPAT_BITMAP | MSFS_FEATURE_INCOMPAT_GROUPS | \
+		MSFS_FEATURE_INCOMPAT_DIRENT)
+#define MSFS_FEATURE_INCOMPAT_SUPP (MSFS_FEATURE_INCOMPAT_REQ | \
+		MSFS_FEATURE_INCOMPAT_DIR_INDEX | MSFS_FEATURE_INCOMPAT_UNWRITTEN | \
+		MSFS_FEATURE_INCOMPAT_INLINE_DATA)
+
 /*
  * This is an simple filesystem mouse filesystem only for learn Linux filesystem
 --------------------------------------------------------------------------------------------------------------------
-MRB 1024 | super block 1024 | imap n*1024 | zmap n*1024 | inodes 1024*8*sizeof(inode) | first data zone 1024 | datazone
+MRB 1024 | super block 1024 | group descriptors n*1024 | group 0 | group 1 | ... | group n-1
+---------------------------------------------------------------------------------------------------------------------
+Every group:
+--------------------------------------------------------------------------------------------------------------------
+block bitmap 1024 | inode bitmap 1024 | inodes s_inodes_per_group*sizeof(inode) | datazone
 ---------------------------------------------------------------------------------------------------------------------
 Note:
-1,imap and zmap we do not use bit, we using byte ,sunch one block 1024 byte, so we only can map 1024;
+1,block and inode bitmaps use one bit per object (little endian bit order), so one group has at most 8192 blocks
+  and 8192 inodes, bits past the last object stay set, the group's own bitmaps and inodes are marked used;
 2, Our index all from 0
 3, Inode i_no 0 is using for invalid inode, can not using for an file .....
-4, Super block s_firstdatazone is device 1024 block number from 0
-5, Super block s_nzones is device has total 1024 block count
+4, Inode i_no n lives in group n / s_inodes_per_group, block b in group (b - s_first_data_block) / s_blocks_per_group
+5, Super block s_blocks_count is device has total 1024 block count
+6, File data is mapped by the extent tree rooted in i_zone[], directory size is always whole blocks
+7, A directory with more than one block gets a hash index mapped past i_size, at logical block MSFS_DX_BLOCK
+8, With INLINE_DATA an inode is s_inode_size bytes, struct msfs_inode and then its tail, a small regular
+  file keeps its contents in i_zone[] followed by the tail instead of an extent tree
 
-An example:
+An example, 2 groups of 8 blocks with 15 inodes each:
 
 --------------------------------------------------------------------------------------------------------------------
-0 | 1 super block | 2 imap | 3 zmap | 4 inode | 5 first data zone for root dir | 6 data | 7 data| 8 data |
+0 | 1 super block | 2 descriptors | 3 bbitmap | 4 ibitmap | 5 inode | 6 root dir | 7..10 data | 11 bbitmap | 12 ibitmap | ...
 ---------------------------------------------------------------------------------------------------------------------
 Super Block:
-s_ninodes:
-s_nzones: 9
-s_imap_blocks:1
-s_zmap_blocks:1
-s_firstdatazone:5
+s_blocks_count: 19
+s_inodes_count: 30
+s_first_data_block: 3
+s_blocks_per_group: 8
+s_inodes_per_group: 15
 
 This an very simple filesystem
 */
 
 
 struct msfs_super_block {
-	__u16 s_ninodes;
-    __u16 s_nzones; //all zones contain super block and MRBN
+	__u16 s_ninodes; //s_ninodes .. s_firstdatazone describe the layout before GROUPS, now 0
+    __u16 s_nzones;
 	__u16 s_imap_blocks;
 	__u16 s_zmap_blocks;
-    __u16 s_firstdatazone; //firstzone from 0 cal
+    __u16 s_firstdatazone;
 	__u16 s_magic;
+	__u16 s_feature_incompat;
+	__u16 s_inode_size; //bytes per inode with INLINE_DATA, else sizeof(struct msfs_inode)
+	__u32 s_blocks_count; //all blocks contain super block and MRBN
+	__u32 s_inodes_count;
+	__u32 s_first_data_block; //first block of group 0
+	__u32 s_blocks_per_group;
+	__u32 s_inodes_per_group;
+	__u32 s_free_blocks_count; //written back at sync and umount, checked at mount
+	__u32 s_free_inodes_count;
 };
 
+/* the descriptor table starts at block 2 */
+struct msfs_group_desc {
+	__u32 bg_block_bitmap;
+	__u32 bg_inode_bitmap;
+	__u32 bg_inode_table;
+	__u16 bg_free_blocks_count;
+	__u16 bg_free_inodes_count;
+};
+
+#define MSFS_GDT_BLOCK 2
+#define MSFS_DESC_PER_BLOCK (MSFS_BLOCK_SIZE / sizeof(struct msfs_group_desc))
 
 struct msfs_inode {
 	__u16 i_mode;
@@ -57,13 +105,105 @@ struct msfs_inode {
 	__u32 i_mtime;
 	__u32 i_ctime;
 	__u16  r_dev; //linux dev using no support 
+	__u16 i_flags;
 	__u32 i_zone[10];
 };
 
+#define MSFS_INDEX_FL 0x0001 //directory has a hash index, see msfs_dx_root
+#define MSFS_INLINE_DATA_FL 0x0002 //contents in i_zone[] and the inode tail, no extent tree
+
+#define MSFS_INODE_SIZE_MAX 128 //s_inode_size mkfs picks for INLINE_DATA
+
+/*
+ * Extent tree, the 40 bytes of i_zone[] are the root: one header followed by
+ * MSFS_EXT_ROOT_MAX entries. At depth 0 the entries are msfs_extent records,
+ * above that msfs_extent_idx records which point to a block holding another
+ * header and MSFS_EXT_BLOCK_MAX entries one level down.
+ */
+#define MSFS_EXT_MAGIC 0xf30b
+#define MSFS_EXT_MAX_DEPTH 4
+#define MSFS_EXT_MAX_LEN 0xffff
+
+struct msfs_extent_header {
+	__u16 eh_magic;
+	__u16 eh_entries; //valid entries after the header
+	__u16 eh_max; //capacity of this node
+	__u16 eh_depth; //0 means entries are msfs_extent
+};
+
+struct msfs_extent {
+	__u32 ee_block; //first logical block
+	__u32 ee_start; //first physical block
+	__u16 ee_len;
+	__u16 ee_flags;
+};
+
+#define MSFS_EXT_UNWRITTEN 0x0001 //allocated by fallocate, reads as zeros until written
+
+struct msfs_extent_idx {
+	__u32 ei_block; //first logical block below this index
+	__u32 ei_leaf; //physical block of the child node
+	__u32 ei_unused;
+};
+
+#define MSFS_EXT_ROOT_MAX ((sizeof(((struct msfs_inode *)0)->i_zone) - \
+		sizeof(struct msfs_extent_header)) / sizeof(struct msfs_extent))
+#define MSFS_EXT_BLOCK_MAX ((MSFS_BLOCK_SIZE - sizeof(struct msfs_extent_header)) / \
+		sizeof(struct msfs_extent))
+
+/*
+ * Hash index of a directory, stored past i_size from logical block
+ * MSFS_DX_BLOCK: the root, then dx_buckets bucket blocks. Every entry
+ * has a record in bucket hash & (dx_buckets - 1) naming its data block.
+ */
+#define MSFS_DX_MAGIC 0xd1c5
+#define MSFS_DX_BLOCK 0x40000000
+#define MSFS_DX_MAX_BUCKETS 1024
+
+struct msfs_dx_root {
+	__u16 dx_magic;
+	__u16 dx_unused;
+	__u32 dx_buckets; //power of 2
+};
+
+struct msfs_dx_entry {
+	__u32 hash;
+	__u32 block; //physical block holding the entry
+};
+
+struct msfs_dx_bucket {
+	__u32 db_count;
+	__u32 db_unused;
+	struct msfs_dx_entry db_entries[0];
+};
+
+#define MSFS_DX_BUCKET_MAX ((MSFS_BLOCK_SIZE - sizeof(struct msfs_dx_bucket)) / \
+		sizeof(struct msfs_dx_entry))
+
+/*
+ * Directory entries are chained by rec_len through a block, the last one
+ * reaches the end of the block. A removed entry is merged into the one in
+ * front of it, only the first entry of a block is left with inode 0.
+ */
 struct msfs_dir_entry {
-	__u16 inode;
-	char name[MSFS_FILENAME_MAX_LEN];
+	__u32 inode;
+	__u16 rec_len;
+	__u8 name_len;
+	__u8 file_type;
+	char name[0]; //not NUL terminated
 };
 
+#define MSFS_DIR_REC_LEN(name_len) (((name_len) + 8 + 3) & ~3)
+
+#define MSFS_FT_UNKNOWN 0
+#define MSFS_FT_REG_FILE 1
+#define MSFS_FT_DIR 2
+#define MSFS_FT_CHRDEV 3
+#define MSFS_FT_BLKDEV 4
+#define MSFS_FT_FIFO 5
+#define MSFS_FT_SOCK 6
+#define MSFS_FT_SYMLINK 7
+#define MSFS_FT_MAX 8
+
 
 #endif
@@ -4,23 +4,66 @@
 #include "msfs.h"
 #include <linux/fs.h>
 #include <linux/pagemap.h>
-
-#define MSFS_INODES_PER_BLOCK ((MSFS_BLOCK_SIZE)/(sizeof(struct msfs_inode)))
-
+#include <linux/percpu_counter.h>
+#include <linux/rbtree.h>
 
 struct msfs_inode_info {
 	struct msfs_inode mfs_inode;
+	__u8 i_tail[MSFS_INODE_SIZE_MAX - sizeof(struct msfs_inode)]; //on disk after mfs_inode, see inline.c
+	struct rw_semaphore i_data_sem; //protects the extent tree in mfs_inode.i_zone
+	sector_t i_dx_hint; //data block that lost an entry, tried first by add_link
+	int i_dx_retry; //not indexed, the next add_link tries to build the index
+	struct msfs_nc *i_nc; //name cache of a directory, see namecache.c
+	unsigned long i_rsv_start; //reservation window of a regular file, see msfs_new_block
+	unsigned long i_rsv_end;
+	unsigned int i_rsv_size; //blocks the next window asks for
+	unsigned int i_da_blocks; //delayed blocks reserved but not allocated yet, under i_lock
+	int i_da_writeback; //allocating for delayed buffers, may use their reservation, under i_data_sem
+	atomic_t i_unwritten; //page buffers on unwritten blocks, converted once written
 	struct inode vfs_inode;
 };
 
 
+struct msfs_group_info {
+	spinlock_t lock; //protects the bitmaps and free counts of the group
+	struct msfs_group_desc *desc;
+	struct buffer_head *desc_bh;
+	struct buffer_head *block_bitmap;
+	struct buffer_head *inode_bitmap;
+	unsigned long *rsv_bitmap; //in memory only, blocks inside some reservation window
+	struct rb_root free_tree; //free blocks outside the windows, see freeext.c
+};
+
 struct msfs_sb_info {
-	struct buffer_head ** s_imap;
-	struct buffer_head ** s_zmap;
 	struct buffer_head * s_sbh;
 	struct msfs_super_block *s_ms;
+	struct buffer_head ** s_gdt;
+	struct msfs_group_info *s_groups;
+	struct msfs_itable *s_itable; //inode table blocks, see itable.c
+	unsigned long s_groups_count;
+	unsigned long s_gdt_blocks;
+	unsigned long s_blocks_count;
+	unsigned long s_inodes_count;
+	unsigned long s_first_data_block;
+	unsigned long s_blocks_per_group;
+	unsigned long s_inodes_per_group;
+	unsigned long s_itb_per_group; //inode table blocks of each group
+	unsigned int s_inode_size;
+	unsigned int s_inodes_per_block;
+	struct percpu_counter s_freeblocks_counter;
+	struct percpu_counter s_freeinodes_counter;
+	struct percpu_counter s_dirtyblocks_counter; //delayed blocks of all inodes
+	unsigned long s_mount_opt;
 };
 
+#define MSFS_RSV_MIN 8 //blocks of a first reservation window
+#define MSFS_RSV_MAX 256
+
+//free blocks a delayed write leaves for the extent nodes writeback may need
+#define MSFS_DA_SLACK (MSFS_EXT_MAX_DEPTH + 1)
+
+#define MSFS_MOUNT_DISCARD 0x0001 //discard blocks as they are freed
+
 
 
 static inline struct msfs_inode_info *msfs_i(struct inode *inode)
@@ -33,5 +76,54 @@ static inline struct msfs_sb_info *msfs_sb(struct super_block *sb)
 	return sb->s_fs_info;
 }
 
+static inline struct msfs_dir_entry *msfs_next_entry(struct msfs_dir_entry *de)
+{
+	return (struct msfs_dir_entry *)((char *)de + de->rec_len);
+}
+
+static inline int msfs_has_feature(struct super_block *sb, int feature)
+{
+	return msfs_sb(sb)->s_ms->s_feature_incompat & feature;
+}
+
+static inline int msfs_inline(struct inode *inode)
+{
+	return msfs_i(inode)->mfs_inode.i_flags & MSFS_INLINE_DATA_FL;
+}
+
+/* the inline bytes in one piece, i_tail follows i_zone[] in msfs_inode_info */
+static inline char *msfs_inline_data(struct inode *inode)
+{
+	BUILD_BUG_ON(offsetof(struct msfs_inode_info, i_tail) !=
+		     offsetof(struct msfs_inode_info, mfs_inode) + sizeof(struct msfs_inode));
+	return (char *)msfs_i(inode)->mfs_inode.i_zone;
+}
+
+/* bytes an inline file can hold: i_zone[] and the inode tail, 0 without INLINE_DATA */
+static inline unsigned int msfs_inline_max(struct super_block *sb)
+{
+	if (!msfs_has_feature(sb, MSFS_FEATURE_INCOMPAT_INLINE_DATA))
+		return 0;
+	return sizeof(((struct msfs_inode *)0)->i_zone) +
+		msfs_sb(sb)->s_inode_size - sizeof(struct msfs_inode);
+}
+
+static inline unsigned long msfs_block_group(struct msfs_sb_info *sbi, unsigned long block)
+{
+	return (block - sbi->s_first_data_block) / sbi->s_blocks_per_group;
+}
+
+static inline unsigned long msfs_group_first_block(struct msfs_sb_info *sbi, unsigned long group)
+{
+	return sbi->s_first_data_block + group * sbi->s_blocks_per_group;
+}
+
+/* the last group may be shorter than the others */
+static inline unsigned long msfs_group_blocks(struct msfs_sb_info *sbi, unsigned long group)
+{
+	return min_t(unsigned long, sbi->s_blocks_per_group,
+		     sbi->s_blocks_count - msfs_group_first_block(sbi, group));
+}
+
 
 #endif
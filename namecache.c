@@ -0,0 +1,302 @@
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/hash.h>
+#include <linux/dcache.h>
+#include <linux/shrinker.h>
+#include "inode.h"
+
+/*
+ * In memory name cache of a directory, name -> (ino, block, offset), built
+ * from the data blocks the first time the directory is searched. Once it
+ * exists it holds every entry except "." and "..", so a miss is a real miss.
+ *
+ * The cache is only touched with the directory i_mutex held, the shrinker
+ * takes it with mutex_trylock and skips busy directories. msfs_nc_lock
+ * covers the LRU list and msfs_i(dir)->i_nc against eviction.
+ */
+
+#define MSFS_NC_MIN_BITS 4
+
+struct msfs_nc_entry {
+    struct hlist_node node;
+    unsigned int hash;
+    ino_t ino;
+    sector_t block; //physical block and offset of the msfs_dir_entry
+    unsigned short offset;
+    unsigned char len;
+    char name[0];
+};
+
+struct msfs_nc {
+    struct list_head lru;
+    struct inode *dir;
+    int referenced;
+    unsigned int count;
+    unsigned int bits;
+    struct hlist_head *table;
+};
+
+static LIST_HEAD(msfs_nc_list);
+static DEFINE_SPINLOCK(msfs_nc_lock);
+static atomic_t msfs_nc_entries;
+static int msfs_nc_caches; //under msfs_nc_lock
+
+static int msfs_nc_dots(const char *name, int len)
+{
+    return name[0] == '.' && (len == 1 || (len == 2 && name[1] == '.'));
+}
+
+static struct hlist_head *msfs_nc_head(struct msfs_nc *nc, unsigned int hash)
+{
+    return &nc->table[hash_32(hash, nc->bits)];
+}
+
+static void msfs_nc_free(struct msfs_nc *nc)
+{
+    struct msfs_nc_entry *e;
+    struct hlist_node *tmp;
+    unsigned int i;
+
+    for (i = 0; i < (1U << nc->bits); i++) {
+        hlist_for_each_entry_safe(e, tmp, &nc->table[i], node)
+            kfree(e);
+    }
+    atomic_sub(nc->count, &msfs_nc_entries);
+    kfree(nc->table);
+    kfree(nc);
+}
+
+static struct msfs_nc_entry *msfs_nc_lookup(struct msfs_nc *nc, const char *name,
+            int len, unsigned int hash)
+{
+    struct msfs_nc_entry *e;
+
+    hlist_for_each_entry(e, msfs_nc_head(nc, hash), node) {
+        if (e->hash == hash && e->len == len && !memcmp(e->name, name, len))
+            return e;
+    }
+    return NULL;
+}
+
+//double the table when the chains get longer than two on average
+static void msfs_nc_grow(struct msfs_nc *nc)
+{
+    unsigned int i, bits = nc->bits + 1;
+    struct hlist_head *table, *old = nc->table;
+    struct msfs_nc_entry *e;
+    struct hlist_node *tmp;
+
+    table = kcalloc(1U << bits, sizeof(*table), GFP_NOFS);
+    if (!table)
+        return;
+    nc->table = table;
+    nc->bits = bits;
+    for (i = 0; i < (1U << (bits - 1)); i++) {
+        hlist_for_each_entry_safe(e, tmp, &old[i], node) {
+            hlist_del(&e->node);
+            hlist_add_head(&e->node, msfs_nc_head(nc, e->hash));
+        }
+    }
+    kfree(old);
+}
+
+static int msfs_nc_insert(struct msfs_nc *nc, const char *name, int len,
+            ino_t ino, sector_t block, unsigned int offset)
+{
+    unsigned int hash = full_name_hash(name, len);
+    struct msfs_nc_entry *e = msfs_nc_lookup(nc, name, len, hash);
+
+    if (!e) {
+        e = kmalloc(sizeof(*e) + len, GFP_NOFS);
+        if (!e)
+            return -ENOMEM;
+        e->hash = hash;
+        e->len = len;
+        memcpy(e->name, name, len);
+        hlist_add_head(&e->node, msfs_nc_head(nc, hash));
+        nc->count++;
+        atomic_inc(&msfs_nc_entries);
+        if (nc->count > (2U << nc->bits))
+            msfs_nc_grow(nc);
+    }
+    e->ino = ino;
+    e->block = block;
+    e->offset = offset;
+    return 0;
+}
+
+static struct msfs_nc *msfs_nc_build(struct inode *dir)
+{
+    unsigned long nblocks = dir->i_size / MSFS_BLOCK_SIZE, i;
+    struct msfs_dir_entry *de;
+    struct buffer_head *bh;
+    struct msfs_nc *nc;
+
+    nc = kzalloc(sizeof(*nc), GFP_NOFS);
+    if (!nc)
+        return NULL;
+    nc->dir = dir;
+    nc->bits = MSFS_NC_MIN_BITS;
+    nc->table = kcalloc(1U << nc->bits, sizeof(*nc->table), GFP_NOFS);
+    if (!nc->table)
+        goto fail;
+
+    msfs_dir_readahead(dir, 0, nblocks);
+    for (i = 0; i < nblocks; i++) {
+        bh = msfs_bread(dir, i, 0);
+        if (!bh)
+            goto fail;
+        de = (struct msfs_dir_entry *)bh->b_data;
+        for (; (char *)de < bh->b_data + MSFS_BLOCK_SIZE; de = msfs_next_entry(de)) {
+            if (!msfs_entry_ok(bh, de)) {
+                brelse(bh);
+                goto fail;
+            }
+            if (!de->inode || msfs_nc_dots(de->name, de->name_len))
+                continue;
+            if (msfs_nc_insert(nc, de->name, de->name_len, de->inode,
+                        bh->b_blocknr, (char *)de - bh->b_data)) {
+                brelse(bh);
+                goto fail;
+            }
+        }
+        brelse(bh);
+    }
+    return nc;
+fail:
+    msfs_nc_free(nc);
+    return NULL;
+}
+
+/*
+ * Look name up in the cache of dir, building it first if needed. Returns 1
+ * with the location filled in, 0 when the name does not exist, or -ENOENT
+ * when there is no cache to answer and the caller must search the blocks.
+ */
+int msfs_nc_find(struct inode *dir, const char *name, int len, ino_t *ino,
+            sector_t *block, unsigned int *offset)
+{
+    struct msfs_inode_info *ei = msfs_i(dir);
+    struct msfs_nc_entry *e;
+    struct msfs_nc *nc;
+
+    if (msfs_nc_dots(name, len))
+        return -ENOENT;
+
+    nc = ei->i_nc;
+    if (!nc) {
+        nc = msfs_nc_build(dir);
+        if (!nc)
+            return -ENOENT;
+        spin_lock(&msfs_nc_lock);
+        list_add(&nc->lru, &msfs_nc_list);
+        msfs_nc_caches++;
+        ei->i_nc = nc;
+        spin_unlock(&msfs_nc_lock);
+    }
+    nc->referenced = 1;
+
+    e = msfs_nc_lookup(nc, name, len, full_name_hash(name, len));
+    if (!e)
+        return 0;
+    *ino = e->ino;
+    if (block)
+        *block = e->block;
+    if (offset)
+        *offset = e->offset;
+    return 1;
+}
+
+//add or update an entry, a cache that cannot follow is dropped
+void msfs_nc_add(struct inode *dir, const char *name, int len, ino_t ino,
+            sector_t block, unsigned int offset)
+{
+    struct msfs_nc *nc = msfs_i(dir)->i_nc;
+
+    if (nc && !msfs_nc_dots(name, len) &&
+        msfs_nc_insert(nc, name, len, ino, block, offset))
+        msfs_nc_drop(dir);
+}
+
+void msfs_nc_remove(struct inode *dir, const char *name, int len)
+{
+    struct msfs_nc *nc = msfs_i(dir)->i_nc;
+    struct msfs_nc_entry *e;
+
+    if (!nc)
+        return;
+    e = msfs_nc_lookup(nc, name, len, full_name_hash(name, len));
+    if (e) {
+        hlist_del(&e->node);
+        kfree(e);
+        nc->count--;
+        atomic_dec(&msfs_nc_entries);
+    }
+}
+
+void msfs_nc_drop(struct inode *dir)
+{
+    struct msfs_inode_info *ei = msfs_i(dir);
+    struct msfs_nc *nc;
+
+    spin_lock(&msfs_nc_lock);
+    nc = ei->i_nc;
+    if (nc) {
+        list_del(&nc->lru);
+        msfs_nc_caches--;
+        ei->i_nc = NULL;
+    }
+    spin_unlock(&msfs_nc_lock);
+    if (nc)
+        msfs_nc_free(nc);
+}
+
+/*
+ * Free whole caches from the cold end of the LRU. A cache used since the
+ * last pass gets a second chance, a directory busy in some operation is
+ * skipped rather than waited for.
+ */
+static int msfs_nc_shrink(struct shrinker *shrink, struct shrink_control *sc)
+{
+    int nr = sc->nr_to_scan;
+    struct msfs_nc *nc, *tmp;
+    LIST_HEAD(dispose);
+    int n;
+
+    if (nr) {
+        spin_lock(&msfs_nc_lock);
+        n = msfs_nc_caches;
+        while (n-- > 0 && nr > 0 && !list_empty(&msfs_nc_list)) {
+            nc = list_entry(msfs_nc_list.prev, struct msfs_nc, lru);
+            if (nc->referenced || !mutex_trylock(&nc->dir->i_mutex)) {
+                nc->referenced = 0;
+                list_move(&nc->lru, &msfs_nc_list);
+                continue;
+            }
+            list_move(&nc->lru, &dispose);
+            msfs_nc_caches--;
+            msfs_i(nc->dir)->i_nc = NULL;
+            mutex_unlock(&nc->dir->i_mutex);
+            nr -= nc->count;
+        }
+        spin_unlock(&msfs_nc_lock);
+        list_for_each_entry_safe(nc, tmp, &dispose, lru)
+            msfs_nc_free(nc);
+    }
+    return (atomic_read(&msfs_nc_entries) / 100) * sysctl_vfs_cache_pressure;
+}
+
+static struct shrinker msfs_nc_shrinker = {
+    .shrink = msfs_nc_shrink,
+    .seeks = DEFAULT_SEEKS,
+};
+
+void msfs_nc_init(void)
+{
+    register_shrinker(&msfs_nc_shrinker);
+}
+
+void msfs_nc_exit(void)
+{
+    unregister_shrinker(&msfs_nc_shrinker);
+}
@@ -1,6 +1,18 @@
+#include <linux/blkdev.h>
+#include <linux/mpage.h>
+#include <linux/pagevec.h>
+#include <linux/uio.h>
+#include <linux/uaccess.h>
+#include <linux/capability.h>
+#include <linux/falloc.h>
 #include "inode.h"
 #include "msfs_info.h"
 
+static int msfs_get_block(struct inode *inode, sector_t block,
+            struct buffer_head *bh_result, int create);
+static int msfs_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo,
+            u64 start, u64 len);
+
 static int msfs_setattr(struct dentry *dentry, struct iattr *attr)
 {
     struct inode *inode = dentry->d_inode;
@@ -16,6 +28,18 @@ static int msfs_setattr(struct dentry *dentry, struct iattr *attr)
         if (error)
             return error;
 
+        //only what still fits stays inside the inode
+        if (msfs_inline(inode) && attr->ia_size > msfs_inline_max(inode->i_sb)) {
+            error = msfs_inline_spill(inode);
+            if (error)
+                return error;
+        }
+        //the part of the last block past the new size must read as zeros
+        if (!msfs_inline(inode)) {
+            error = block_truncate_page(inode->i_mapping, attr->ia_size, msfs_get_block);
+            if (error)
+                return error;
+        }
         truncate_setsize(inode, attr->ia_size);
         msfs_truncate(inode);
     }
@@ -27,10 +51,21 @@ static int msfs_setattr(struct dentry *dentry, struct iattr *attr)
 
 int msfs_getattr(struct vfsmount *mnt, struct dentry *dentry, struct kstat *stat)
 {
-    struct super_block *sb = dentry->d_sb;
-    generic_fillattr(dentry->d_inode, stat);
-
-    stat->blocks = (sb->s_blocksize / 512) * (stat->size / MSFS_BLOCK_SIZE);
+    struct inode *inode = dentry->d_inode;
+    struct msfs_inode_info *ei = msfs_i(inode);
+    blkcnt_t blocks = 0;
+
+    generic_fillattr(inode, stat);
+
+    //what is allocated, a hole takes nothing and a delayed block counts already
+    if ((S_ISREG(inode->i_mode) || S_ISDIR(inode->i_mode) || S_ISLNK(inode->i_mode)) &&
+        !msfs_inline(inode)) {
+        down_read(&ei->i_data_sem);
+        msfs_ext_blocks(inode, &blocks);
+        up_read(&ei->i_data_sem);
+        blocks += ei->i_da_blocks;
+    }
+    stat->blocks = blocks << (inode->i_blkbits - 9);
     stat->blksize = 512;
     return 0;
 }
@@ -38,10 +73,52 @@ int msfs_getattr(struct vfsmount *mnt, struct dentry *dentry, struct kstat *stat
 const struct inode_operations msfs_file_inode_operations = {
     .setattr	= msfs_setattr,
     .getattr	= msfs_getattr,
+    .fiemap		= msfs_fiemap,
 };
 
+static long msfs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct super_block *sb = file_inode(filp)->i_sb;
+    struct request_queue *q = bdev_get_queue(sb->s_bdev);
+    struct fstrim_range range;
+    int err;
+
+    switch (cmd) {
+    case FITRIM:
+        if (!capable(CAP_SYS_ADMIN))
+            return -EPERM;
+        if (!blk_queue_discard(q))
+            return -EOPNOTSUPP;
+        if (copy_from_user(&range, (struct fstrim_range __user *)arg, sizeof(range)))
+            return -EFAULT;
+        range.minlen = max_t(u64, range.minlen, q->limits.discard_granularity);
+        err = msfs_trim_fs(sb, &range);
+        if (err)
+            return err;
+        if (copy_to_user((struct fstrim_range __user *)arg, &range, sizeof(range)))
+            return -EFAULT;
+        return 0;
+    default:
+        return -ENOTTY;
+    }
+}
+
+//the last writer is gone, nobody needs the reservation window any more
+static int msfs_release_file(struct inode *inode, struct file *filp)
+{
+    if ((filp->f_mode & FMODE_WRITE) && atomic_read(&inode->i_writecount) == 1) {
+        down_write(&msfs_i(inode)->i_data_sem);
+        msfs_discard_reservation(inode);
+        up_write(&msfs_i(inode)->i_data_sem);
+    }
+    return 0;
+}
+
+static long msfs_fallocate(struct file *file, int mode, loff_t offset, loff_t len);
+static loff_t msfs_llseek(struct file *file, loff_t offset, int whence);
+
 const struct file_operations msfs_file_operations = {
-    .llseek		= generic_file_llseek,
+    .llseek		= msfs_llseek,
     .read		= do_sync_read,
     .aio_read	= generic_file_aio_read,
     .write		= do_sync_write,
@@ -49,54 +126,590 @@ const struct file_operations msfs_file_operations = {
     .mmap		= generic_file_mmap,
     .fsync		= generic_file_fsync,
     .splice_read	= generic_file_splice_read,
+    .unlocked_ioctl	= msfs_ioctl,
+    .release	= msfs_release_file,
+    .fallocate	= msfs_fallocate,
 };
 
+//right behind the block in front, so a file grows in one run
+static unsigned long msfs_data_goal(struct inode *inode, sector_t block)
+{
+    struct msfs_sb_info *sbi = msfs_sb(inode->i_sb);
+    sector_t prev;
+
+    if (block && msfs_ext_map(inode, block - 1, 1, &prev, NULL) > 0)
+        return prev + 1;
+    return msfs_group_first_block(sbi, inode->i_ino / sbi->s_inodes_per_group);
+}
+
+/*
+ * Delayed allocation: a buffered write into a hole of a regular file only
+ * reserves a block against s_dirtyblocks_counter and leaves the buffer
+ * unmapped with BH_Delay set. Writeback allocates whole runs of such
+ * buffers at once, invalidatepage hands the reservations of pages that
+ * never get there back, so a file deleted before writeback never touches a
+ * bitmap. Being unmapped, a delayed buffer mpage has not seen allocated
+ * makes it fall back to msfs_writepage, whose get_block allocates it.
+ */
+#define MSFS_DA_BLOCK (~(sector_t)0)
+
+static int msfs_da_reserve(struct inode *inode)
+{
+    int err = msfs_claim_blocks(msfs_sb(inode->i_sb), 1);
+
+    if (err)
+        return err;
+    spin_lock(&inode->i_lock);
+    msfs_i(inode)->i_da_blocks++;
+    spin_unlock(&inode->i_lock);
+    return 0;
+}
+
+static void msfs_da_release(struct inode *inode, unsigned int n)
+{
+    struct msfs_inode_info *ei = msfs_i(inode);
+
+    spin_lock(&inode->i_lock);
+    if (n > ei->i_da_blocks) {
+        printk("msfs: inode %lu releases %u delayed blocks of %u\n", inode->i_ino,
+            n, ei->i_da_blocks);
+        n = ei->i_da_blocks;
+    }
+    ei->i_da_blocks -= n;
+    spin_unlock(&inode->i_lock);
+    percpu_counter_sub(&msfs_sb(inode->i_sb)->s_dirtyblocks_counter, n);
+}
+
+/*
+ * Allocate the hole at block, as much of it as the caller maps and in one
+ * run when the free extent tree has one, as an extent with flags. Returns
+ * the number of blocks now mapped at *phys. Called with i_data_sem held
+ * for write.
+ */
+static int msfs_fill_hole(struct inode *inode, sector_t block, unsigned int max_blocks,
+            sector_t *phys, unsigned int flags)
+{
+    int err = msfs_ext_hole(inode, block, max_blocks);
+    unsigned int n;
+
+    if (err <= 0)
+        return err ? err : -EIO;
+    n = err;
+    *phys = msfs_new_blocks(inode, msfs_data_goal(inode, block), &n);
+    if (!*phys) {
+        printk("no blocks to get\n");
+        return -ENOSPC;
+    }
+    err = msfs_ext_insert(inode, block, *phys, n, flags);
+    if (err < 0) {
+        msfs_free_blocks(inode->i_sb, *phys, n);
+        return err;
+    }
+    return n;
+}
+
+/*
+ * Map block through the extent tree. bh_result->b_size says how many bytes
+ * the caller can take, on return it covers the whole contiguous run.
+ */
 static int msfs_get_block(struct inode *inode, sector_t block,
             struct buffer_head *bh_result, int create)
 {
-    int err = -EIO;
-    int free_block = 0;
+    int count;
+    sector_t phys = 0;
+    unsigned int flags = 0;
+    unsigned int max_blocks = bh_result->b_size >> inode->i_blkbits;
     struct msfs_inode_info *m_inode = msfs_i(inode);
 
-    if (block >= 10)
-    {
-        return err;
-    }
+    if (!max_blocks)
+        max_blocks = 1;
+    //inline data never goes through here, i_zone is no extent root then
+    if (msfs_inline(inode))
+        return -EIO;
+
+    down_read(&m_inode->i_data_sem);
+    count = msfs_ext_map(inode, block, max_blocks, &phys, &flags);
+    up_read(&m_inode->i_data_sem);
 
-    if (m_inode->mfs_inode.i_zone[block] == 0 && !create)
+    //a hole reads as zeros
+    if (count == 0 && !create)
     {
-        return err;
+        down_read(&m_inode->i_data_sem);
+        count = msfs_ext_hole(inode, block, max_blocks);
+        up_read(&m_inode->i_data_sem);
+        if (count < 0)
+            return count;
+        bh_result->b_size = max(count, 1) << inode->i_blkbits;
+        return 0;
     }
 
-    if (m_inode->mfs_inode.i_zone[block] == 0)
+    if (count == 0)
     {
-        free_block = msfs_new_block(inode->i_sb);
-        if (!free_block)
+        down_write(&m_inode->i_data_sem);
+        count = msfs_ext_map(inode, block, max_blocks, &phys, &flags);
+        if (count == 0)
         {
-            printk("no blocks to get\n");
-            return err;
+            //writepage of a delayed buffer uses its reservation
+            m_inode->i_da_writeback = buffer_delay(bh_result);
+            count = msfs_fill_hole(inode, block, max_blocks, &phys, 0);
+            m_inode->i_da_writeback = 0;
+            flags = 0;
+            if (count > 0)
+            {
+                set_buffer_new(bh_result);
+                mark_inode_dirty(inode);
+            }
         }
-        m_inode->mfs_inode.i_zone[block] = free_block;
-        mark_inode_dirty(inode);
+        up_write(&m_inode->i_data_sem);
     }
-    else
+
+    if (count < 0)
+    {
+        return count;
+    }
+
+    if (flags & MSFS_EXT_UNWRITTEN)
     {
-        free_block = m_inode->mfs_inode.i_zone[block];
+        //preallocated blocks read as zeros, the buffer stays unmapped
+        if (!create)
+        {
+            bh_result->b_size = count << inode->i_blkbits;
+            return 0;
+        }
+        /*
+         * Written in place, the caller zeroes what it does not write. The
+         * extent stays unwritten until the data is on disk, whoever does
+         * the I/O converts it, see msfs_convert_written.
+         */
+        set_buffer_new(bh_result);
+        set_buffer_unwritten(bh_result);
     }
 
-    map_bh(bh_result, inode->i_sb, free_block);
+    //a delayed buffer written by writepage, its reservation is used up now
+    if (buffer_delay(bh_result))
+        msfs_da_release(inode, 1);
+    map_bh(bh_result, inode->i_sb, phys);
+    bh_result->b_size = count << inode->i_blkbits;
 
     return 0;
 }
+
+/*
+ * Read block of a directory or other metadata file, with create set the
+ * block is allocated and handed back zeroed.
+ */
+struct buffer_head *msfs_bread(struct inode *inode, sector_t block, int create)
+{
+    struct buffer_head dummy, *bh;
+
+    dummy.b_state = 0;
+    dummy.b_size = inode->i_sb->s_blocksize;
+    if (msfs_get_block(inode, block, &dummy, create) || !buffer_mapped(&dummy))
+        return NULL;
+
+    if (!buffer_new(&dummy))
+        return sb_bread(inode->i_sb, dummy.b_blocknr);
+
+    bh = sb_getblk(inode->i_sb, dummy.b_blocknr);
+    if (!bh)
+        return NULL;
+    lock_buffer(bh);
+    memset(bh->b_data, 0, bh->b_size);
+    set_buffer_uptodate(bh);
+    unlock_buffer(bh);
+    mark_buffer_dirty(bh);
+    return bh;
+}
+
+/*
+ * Start reads for up to count data blocks of a directory from block start,
+ * a whole extent at a time and under one plug so neighbouring blocks go
+ * down as a few large requests. msfs_bread then finds them in the cache.
+ */
+void msfs_dir_readahead(struct inode *dir, sector_t start, unsigned long count)
+{
+    struct msfs_inode_info *m_inode = msfs_i(dir);
+    sector_t end = dir->i_size / MSFS_BLOCK_SIZE, phys;
+    struct blk_plug plug;
+    int n, i;
+
+    if (end > start + count)
+        end = start + count;
+    if (end <= start + 1)
+        return;
+
+    blk_start_plug(&plug);
+    down_read(&m_inode->i_data_sem);
+    while (start < end)
+    {
+        n = msfs_ext_map(dir, start, end - start, &phys, NULL);
+        if (n < 0)
+            break;
+        if (n == 0)
+        {
+            start++;
+            continue;
+        }
+        for (i = 0; i < n; i++)
+            sb_breadahead(dir->i_sb, phys + i);
+        start += n;
+    }
+    up_read(&m_inode->i_data_sem);
+    blk_finish_plug(&plug);
+}
+
 static int msfs_readpage(struct file *file, struct page *page)
 {
+    if (msfs_inline(page->mapping->host))
+        return msfs_inline_readpage(page);
     return block_read_full_page(page, msfs_get_block);
 }
 
 
+//mapped runs from msfs_get_block let mpage build one bio per extent
+static int msfs_readpages(struct file *file, struct address_space *mapping,
+            struct list_head *pages, unsigned nr_pages)
+{
+    //nothing to read ahead, readpage copies page 0 from the inode
+    if (msfs_inline(mapping->host))
+        return 0;
+    return mpage_readpages(mapping, pages, nr_pages, msfs_get_block);
+}
+
+//get_block for the buffers of a page, counts those left on unwritten blocks
+static int msfs_page_get_block(struct inode *inode, sector_t block,
+            struct buffer_head *bh_result, int create)
+{
+    int err = msfs_get_block(inode, block, bh_result, create);
+
+    if (!err && buffer_unwritten(bh_result))
+        atomic_inc(&msfs_i(inode)->i_unwritten);
+    return err;
+}
+
+//write_begin of a regular file: blocks in holes are only reserved
+int msfs_da_get_block(struct inode *inode, sector_t block,
+            struct buffer_head *bh_result, int create)
+{
+    struct msfs_inode_info *m_inode = msfs_i(inode);
+    unsigned int flags;
+    sector_t phys;
+    int err;
+
+    //rewritten before writeback, the block is reserved already
+    if (buffer_delay(bh_result))
+        return 0;
+    down_read(&m_inode->i_data_sem);
+    err = msfs_ext_map(inode, block, 1, &phys, &flags);
+    up_read(&m_inode->i_data_sem);
+    if (err < 0)
+        return err;
+    //preallocated blocks stay delayed like holes, see msfs_unwritten_mask
+    if (err && !(flags & MSFS_EXT_UNWRITTEN)) {
+        map_bh(bh_result, inode->i_sb, phys);
+        return 0;
+    }
+
+    err = msfs_da_reserve(inode);
+    if (err)
+        return err;
+    bh_result->b_bdev = inode->i_sb->s_bdev;
+    bh_result->b_blocknr = MSFS_DA_BLOCK;
+    set_buffer_new(bh_result);
+    set_buffer_delay(bh_result);
+    return 0;
+}
+
+//allocate logical blocks start..start+len of a file, in as few runs as the free extents allow
+static int msfs_da_alloc(struct inode *inode, sector_t start, unsigned int len)
+{
+    struct msfs_inode_info *m_inode = msfs_i(inode);
+    sector_t phys;
+    int n = 0;
+
+    down_write(&m_inode->i_data_sem);
+    //these blocks and their extent nodes were reserved by msfs_da_reserve
+    m_inode->i_da_writeback = 1;
+    while (len) {
+        //preallocated runs are skipped, their buffers stay delayed
+        n = msfs_ext_map(inode, start, len, &phys, NULL);
+        if (n == 0)
+            n = msfs_fill_hole(inode, start, len, &phys, 0);
+        if (n < 0)
+            break;
+        start += n;
+        len -= n;
+    }
+    m_inode->i_da_writeback = 0;
+    up_write(&m_inode->i_data_sem);
+    mark_inode_dirty(inode);
+    return n < 0 ? n : 0;
+}
+
+//the data of blocks start..start+len - 1 is on disk, preallocated ones among them become written
+static int msfs_convert_written(struct inode *inode, sector_t start, unsigned int len)
+{
+    struct msfs_inode_info *m_inode = msfs_i(inode);
+    unsigned int flags;
+    sector_t phys;
+    int n = 0, err;
+
+    down_write(&m_inode->i_data_sem);
+    //splitting the extent may need a node, the write is done already
+    m_inode->i_da_writeback = 1;
+    while (len) {
+        n = msfs_ext_map(inode, start, len, &phys, &flags);
+        if (n == 0)
+            n = msfs_ext_hole(inode, start, len);
+        else if (n > 0 && (flags & MSFS_EXT_UNWRITTEN)) {
+            err = msfs_ext_convert(inode, start, n);
+            if (err)
+                n = err;
+        }
+        if (n <= 0)
+            break;
+        start += n;
+        len -= n;
+    }
+    m_inode->i_da_writeback = 0;
+    up_write(&m_inode->i_data_sem);
+    mark_inode_dirty(inode);
+    return n < 0 ? n : 0;
+}
+
+/*
+ * Preallocated blocks are written in place, their extents are converted
+ * only once the data is on disk so nothing can read the old contents of
+ * the blocks before. Until writeback their buffers are delayed and so
+ * unmapped, mpage never writes such a page itself but hands it to
+ * msfs_writepage. There msfs_page_get_block maps them marked unwritten,
+ * the mask of the locked page has a bit for each buffer about to be
+ * written that may become one, and msfs_convert_page waits for the I/O
+ * and converts those that were.
+ */
+static unsigned long msfs_unwritten_mask(struct page *page)
+{
+    loff_t pos = page_offset(page), size = i_size_read(page->mapping->host);
+    struct buffer_head *bh, *head;
+    unsigned long mask = 0;
+    int i = 0;
+
+    BUILD_BUG_ON(PAGE_CACHE_SIZE / MSFS_BLOCK_SIZE > BITS_PER_LONG);
+    if (!page_has_buffers(page))
+        return 0;
+    bh = head = page_buffers(page);
+    do {
+        //unmapped ones get their block from msfs_page_get_block
+        if (buffer_dirty(bh) && pos < size && (buffer_unwritten(bh) || !buffer_mapped(bh)))
+            mask |= 1UL << i;
+        pos += bh->b_size;
+        i++;
+    } while ((bh = bh->b_this_page) != head);
+    return mask;
+}
+
+static void msfs_convert_page(struct inode *inode, struct page *page, unsigned long mask)
+{
+    sector_t block = (sector_t)page->index << (PAGE_CACHE_SHIFT - inode->i_blkbits);
+    struct buffer_head *bh, *head;
+    unsigned long done = 0;
+    int i = 0, nr, end, n = 0, err = 0;
+
+    wait_on_page_writeback(page);
+    lock_page(page);
+    if (page->mapping != inode->i_mapping || !page_has_buffers(page)) {
+        unlock_page(page);
+        return;
+    }
+    bh = head = page_buffers(page);
+    do {
+        if ((mask & (1UL << i)) && buffer_unwritten(bh) && !buffer_write_io_error(bh))
+            done |= 1UL << i;
+        i++;
+    } while ((bh = bh->b_this_page) != head);
+    nr = i;
+
+    //a run of buffers at a time
+    for (i = 0; i < nr && !err; i = end + 1) {
+        for (end = i; end < nr && (done & (1UL << end)); end++)
+            ;
+        if (end > i)
+            err = msfs_convert_written(inode, block + i, end - i);
+    }
+
+    if (err) {
+        printk("msfs: unable to convert written blocks of inode %lu\n", inode->i_ino);
+        mapping_set_error(inode->i_mapping, err);
+    }
+    i = 0;
+    do {
+        if (done & (1UL << i)) {
+            clear_buffer_unwritten(bh);
+            //unmapped and dirty again, the next writeback goes through msfs_writepage
+            if (err) {
+                clear_buffer_mapped(bh);
+                mark_buffer_dirty(bh);
+            }
+            n++;
+        }
+        i++;
+    } while ((bh = bh->b_this_page) != head);
+    if (n)
+        atomic_sub(n, &msfs_i(inode)->i_unwritten);
+    unlock_page(page);
+}
+
+//mpage writes a page without buffers straight to its blocks, preallocated ones go through msfs_writepage
+static int msfs_mpage_get_block(struct inode *inode, sector_t block,
+            struct buffer_head *bh_result, int create)
+{
+    int err = msfs_get_block(inode, block, bh_result, create);
+
+    if (!err && buffer_unwritten(bh_result))
+        return -EAGAIN;
+    return err;
+}
+
+/*
+ * Give the delayed buffers of a batch of locked dirty pages their blocks,
+ * contiguous runs of them across the pages are allocated as one.
+ */
+static int msfs_da_map_pages(struct inode *inode, struct pagevec *pvec, pgoff_t end)
+{
+    struct msfs_inode_info *m_inode = msfs_i(inode);
+    struct buffer_head *bh, *head;
+    unsigned int shift = PAGE_CACHE_SHIFT - inode->i_blkbits, len = 0;
+    sector_t block, start = 0, phys;
+    unsigned int flags;
+    struct page *page;
+    int i, err = 0;
+
+    for (i = 0; i < pagevec_count(pvec) && !err; i++) {
+        page = pvec->pages[i];
+        if (page->mapping != inode->i_mapping || page->index > end || !page_has_buffers(page))
+            continue;
+        block = (sector_t)page->index << shift;
+        bh = head = page_buffers(page);
+        do {
+            if (buffer_delay(bh)) {
+                if (len && block != start + len) {
+                    err = msfs_da_alloc(inode, start, len);
+                    len = 0;
+                }
+                if (!len)
+                    start = block;
+                len++;
+            }
+            block++;
+        } while ((bh = bh->b_this_page) != head);
+    }
+    if (len && !err)
+        err = msfs_da_alloc(inode, start, len);
+
+    //whatever got allocated is handed to its buffers, even after an error
+    for (i = 0; i < pagevec_count(pvec); i++) {
+        page = pvec->pages[i];
+        if (page->mapping != inode->i_mapping || page->index > end || !page_has_buffers(page))
+            continue;
+        block = (sector_t)page->index << shift;
+        bh = head = page_buffers(page);
+        do {
+            if (buffer_delay(bh)) {
+                down_read(&m_inode->i_data_sem);
+                len = msfs_ext_map(inode, block, 1, &phys, &flags);
+                up_read(&m_inode->i_data_sem);
+                if (len == 1 && !(flags & MSFS_EXT_UNWRITTEN)) {
+                    map_bh(bh, inode->i_sb, phys);
+                    clear_buffer_delay(bh);
+                    unmap_underlying_metadata(bh->b_bdev, phys);
+                    msfs_da_release(inode, 1);
+                }
+            }
+            block++;
+        } while ((bh = bh->b_this_page) != head);
+    }
+    return err;
+}
+
 static int msfs_writepage(struct page *page, struct writeback_control *wbc)
 {
-    return block_write_full_page(page, msfs_get_block, wbc);
+    struct inode *inode = page->mapping->host;
+    unsigned long mask;
+    int err;
+
+    if (msfs_inline(inode))
+        return msfs_inline_writepage(page);
+    mask = msfs_unwritten_mask(page);
+    err = block_write_full_page(page, msfs_page_get_block, wbc);
+    if (!err && mask && atomic_read(&msfs_i(inode)->i_unwritten))
+        msfs_convert_page(inode, page, mask);
+    return err;
+}
+
+/*
+ * The delayed buffers of the dirty pages in range get their blocks first,
+ * a pagevec of locked pages at a time, so mpage sees whole mapped runs.
+ * Those on preallocated blocks stay delayed for msfs_writepage.
+ */
+static int msfs_writepages(struct address_space *mapping,
+            struct writeback_control *wbc)
+{
+    struct inode *inode = mapping->host;
+    pgoff_t index = 0, end = -1;
+    struct pagevec pvec;
+    int nr, i, err = 0;
+
+    //mpage would map page 0 of an inline file to a block
+    if (msfs_inline(inode))
+        return generic_writepages(mapping, wbc);
+    if (!wbc->range_cyclic) {
+        index = wbc->range_start >> PAGE_CACHE_SHIFT;
+        end = wbc->range_end >> PAGE_CACHE_SHIFT;
+    }
+    pagevec_init(&pvec, 0);
+    while (!err && msfs_i(inode)->i_da_blocks && index <= end &&
+           (nr = pagevec_lookup_tag(&pvec, mapping, &index, PAGECACHE_TAG_DIRTY,
+                        PAGEVEC_SIZE))) {
+        for (i = 0; i < nr; i++)
+            lock_page(pvec.pages[i]);
+        err = msfs_da_map_pages(inode, &pvec, end);
+        for (i = 0; i < nr; i++)
+            unlock_page(pvec.pages[i]);
+        pagevec_release(&pvec);
+        cond_resched();
+    }
+    if (err)
+        return err;
+    return mpage_writepages(mapping, wbc, msfs_mpage_get_block);
+}
+
+//reservations of delayed buffers that will never be written go back
+static void msfs_invalidatepage(struct page *page, unsigned long offset)
+{
+    struct buffer_head *bh, *head;
+    unsigned long curr = 0;
+    unsigned int n = 0, u = 0;
+
+    if (page_has_buffers(page)) {
+        bh = head = page_buffers(page);
+        do {
+            if (curr >= offset && buffer_delay(bh)) {
+                clear_buffer_delay(bh);
+                n++;
+            }
+            //nothing left to convert for these
+            if (curr >= offset && buffer_unwritten(bh)) {
+                clear_buffer_unwritten(bh);
+                u++;
+            }
+            curr += bh->b_size;
+        } while ((bh = bh->b_this_page) != head);
+        if (n)
+            msfs_da_release(page->mapping->host, n);
+        if (u)
+            atomic_sub(u, &msfs_i(page->mapping->host)->i_unwritten);
+    }
+    block_invalidatepage(page, offset);
 }
 
 static void msfs_write_failed(struct address_space *mapping, loff_t to)
@@ -113,88 +726,473 @@ static int msfs_write_begin(struct file *file, struct address_space *mapping,
             loff_t pos, unsigned len, unsigned flags,
             struct page **pagep, void **fsdata)
 {
+    struct inode *inode = mapping->host;
     int ret;
 
+    if (msfs_inline(inode)) {
+        if (pos + len <= msfs_inline_max(inode->i_sb))
+            return msfs_inline_write_begin(mapping, flags, pagep);
+        ret = msfs_inline_spill(inode);
+        if (ret)
+            return ret;
+    }
     ret = block_write_begin(mapping, pos, len, flags, pagep,
-                msfs_get_block);
+                S_ISREG(mapping->host->i_mode) ? msfs_da_get_block : msfs_get_block);
     if (unlikely(ret))
         msfs_write_failed(mapping, pos + len);
 
     return ret;
 }
 
+static int msfs_write_end(struct file *file, struct address_space *mapping,
+            loff_t pos, unsigned len, unsigned copied,
+            struct page *page, void *fsdata)
+{
+    if (msfs_inline(mapping->host))
+        return msfs_inline_write_end(mapping->host, pos, copied, page);
+    return generic_write_end(file, mapping, pos, len, copied, page, fsdata);
+}
+
+/*
+ * O_DIRECT has to line up with the device sectors in file offset, buffer
+ * address and length, anything else is refused instead of bounced.
+ */
+static int msfs_dio_aligned(struct inode *inode, const struct iovec *iov,
+            loff_t offset, unsigned long nr_segs)
+{
+    unsigned int mask = bdev_logical_block_size(inode->i_sb->s_bdev) - 1;
+    unsigned long i;
+
+    if (offset & mask)
+        return 0;
+    for (i = 0; i < nr_segs; i++)
+    {
+        if (((unsigned long)iov[i].iov_base | iov[i].iov_len) & mask)
+            return 0;
+    }
+    return 1;
+}
+
+//whether a block under bytes from..from + len - 1 is preallocated
+static int msfs_preallocated(struct inode *inode, loff_t from, size_t len)
+{
+    sector_t b = from >> inode->i_blkbits, last = (from + len - 1) >> inode->i_blkbits, phys;
+    unsigned int flags, max;
+    int n;
+
+    down_read(&msfs_i(inode)->i_data_sem);
+    for (; b <= last; b += n) {
+        max = min_t(sector_t, last - b + 1, MSFS_EXT_MAX_LEN);
+        n = msfs_ext_map(inode, b, max, &phys, &flags);
+        if (n > 0 && (flags & MSFS_EXT_UNWRITTEN))
+            break;
+        if (n == 0)
+            n = msfs_ext_hole(inode, b, max);
+        //an error counts as preallocated, that is the careful way
+        if (n <= 0)
+            break;
+    }
+    up_read(&msfs_i(inode)->i_data_sem);
+    return b <= last;
+}
+
+/*
+ * get_block of an O_DIRECT write into preallocated blocks. Below i_size
+ * the direct I/O code asks without create so holes fall back to the page
+ * cache, preallocated blocks are mapped all the same and written in place.
+ */
+static int msfs_dio_get_block(struct inode *inode, sector_t block,
+            struct buffer_head *bh_result, int create)
+{
+    unsigned int flags;
+    sector_t phys;
+    int n;
+
+    down_read(&msfs_i(inode)->i_data_sem);
+    n = msfs_ext_map(inode, block, 1, &phys, &flags);
+    up_read(&msfs_i(inode)->i_data_sem);
+    if (n > 0 && (flags & MSFS_EXT_UNWRITTEN))
+        create = 1;
+    return msfs_get_block(inode, block, bh_result, create);
+}
+
+//a synchronous O_DIRECT write into preallocated blocks is on disk, they become written
+static void msfs_dio_end_io(struct kiocb *iocb, loff_t offset, ssize_t size,
+            void *private, int ret, bool is_async)
+{
+    struct inode *inode = file_inode(iocb->ki_filp);
+    int bits = inode->i_blkbits;
+
+    if (size > 0 && msfs_convert_written(inode, offset >> bits,
+                ((offset + size - 1) >> bits) - (offset >> bits) + 1))
+        printk("msfs: unable to convert written blocks of inode %lu\n", inode->i_ino);
+    inode_dio_done(inode);
+}
+
+static ssize_t msfs_direct_IO(int rw, struct kiocb *iocb, const struct iovec *iov,
+            loff_t offset, unsigned long nr_segs)
+{
+    struct address_space *mapping = iocb->ki_filp->f_mapping;
+    struct inode *inode = mapping->host;
+    get_block_t *get_block = msfs_get_block;
+    dio_iodone_t *end_io = NULL;
+    ssize_t ret;
+
+    if (!msfs_dio_aligned(inode, iov, offset, nr_segs))
+        return -EINVAL;
+    //no blocks to do I/O to, the page cache takes it
+    if (msfs_inline(inode))
+        return 0;
+    /*
+     * A write into preallocated blocks maps them unwritten, inside i_size
+     * too, and end_io converts what was written once the I/O is done. An
+     * aio completes in interrupt context where i_data_sem cannot be taken,
+     * so that one goes through the page cache instead.
+     */
+    if ((rw & WRITE) && msfs_preallocated(inode, offset, iov_length(iov, nr_segs))) {
+        if (!is_sync_kiocb(iocb))
+            return 0;
+        get_block = msfs_dio_get_block;
+        end_io = msfs_dio_end_io;
+    }
+
+    ret = __blockdev_direct_IO(rw, iocb, inode, inode->i_sb->s_bdev, iov, offset, nr_segs,
+                get_block, end_io, NULL, DIO_LOCKING | DIO_SKIP_HOLES);
+    if (ret < 0 && (rw & WRITE))
+        msfs_write_failed(mapping, offset + iov_length(iov, nr_segs));
+    return ret;
+}
+
 static sector_t msfs_bmap(struct address_space *mapping, sector_t block)
 {
+    if (msfs_inline(mapping->host))
+        return 0;
+    //delayed blocks have no number to tell yet
+    if (msfs_i(mapping->host)->i_da_blocks)
+        filemap_write_and_wait(mapping);
     return generic_block_bmap(mapping, block, msfs_get_block);
 }
 
 const struct address_space_operations msfs_aops = {
     .readpage = msfs_readpage,
+    .readpages = msfs_readpages,
     .writepage = msfs_writepage,
+    .writepages = msfs_writepages,
     .write_begin = msfs_write_begin,
-    .write_end = generic_write_end,
+    .write_end = msfs_write_end,
+    .invalidatepage = msfs_invalidatepage,
     .bmap = msfs_bmap,
+    .direct_IO = msfs_direct_IO,
 };
 
-int msfs_add_link(struct dentry *dentry, struct inode *inode)
+//preallocate the holes of blocks start..end - 1 as unwritten, mapped blocks stay
+static int msfs_prealloc(struct inode *inode, sector_t start, sector_t end)
 {
-    struct inode *dir = dentry->d_parent->d_inode;
-    const char * name = dentry->d_name.name;
-    int namelen = dentry->d_name.len;
-    struct super_block * sb = dir->i_sb;
-    struct msfs_dir_entry *de = NULL;
-    __u32 inumber, i = 0, j = 0, dir_size = sizeof(struct msfs_dir_entry);
-    struct buffer_head *bh_block;
-    int free_block = 0;
-    struct msfs_inode_info *si = msfs_i(dir);
+    struct msfs_inode_info *m_inode = msfs_i(inode);
+    unsigned int max;
+    sector_t phys;
+    int n = 0;
+
+    down_write(&m_inode->i_data_sem);
+    while (start < end) {
+        max = min_t(sector_t, end - start, MSFS_EXT_MAX_LEN);
+        n = msfs_ext_map(inode, start, max, &phys, NULL);
+        if (n == 0)
+            n = msfs_fill_hole(inode, start, max, &phys, MSFS_EXT_UNWRITTEN);
+        if (n < 0)
+            break;
+        start += n;
+    }
+    up_write(&m_inode->i_data_sem);
+    mark_inode_dirty(inode);
+    return n < 0 ? n : 0;
+}
 
-    inumber = MSFS_BLOCK_SIZE / dir_size;
+//whether a block under bytes from..from + len - 1 holds written data
+static int msfs_written(struct inode *inode, loff_t from, unsigned int len)
+{
+    sector_t b = from >> inode->i_blkbits, last = (from + len - 1) >> inode->i_blkbits, phys;
+    unsigned int flags;
+    int n;
+
+    down_read(&msfs_i(inode)->i_data_sem);
+    for (; b <= last; b++) {
+        n = msfs_ext_map(inode, b, 1, &phys, &flags);
+        //an error takes the careful way through the page cache
+        if (n < 0 || (n > 0 && !(flags & MSFS_EXT_UNWRITTEN)))
+            break;
+    }
+    up_read(&msfs_i(inode)->i_data_sem);
+    return b <= last;
+}
+
+/*
+ * Zero bytes from..to - 1 in the page cache, through write_begin so their
+ * blocks are read first or get the zeros written in place. Bytes past i_size are left
+ * alone, so are pages that are neither cached nor written on disk.
+ */
+static int msfs_zero_bytes(struct inode *inode, loff_t from, loff_t to)
+{
+    struct address_space *mapping = inode->i_mapping;
+    struct page *page;
+    unsigned int len;
+    void *fsdata;
+    int err;
+
+    to = min(to, i_size_read(inode));
+    for (; from < to; from += len) {
+        len = min_t(loff_t, to - from, PAGE_CACHE_SIZE - (from & ~PAGE_CACHE_MASK));
+        page = find_get_page(mapping, from >> PAGE_CACHE_SHIFT);
+        if (page)
+            page_cache_release(page);
+        else if (!msfs_written(inode, from, len))
+            continue;
+
+        err = pagecache_write_begin(NULL, mapping, from, len, AOP_FLAG_UNINTERRUPTIBLE,
+                    &page, &fsdata);
+        if (err)
+            return err;
+        zero_user(page, from & ~PAGE_CACHE_MASK, len);
+        err = pagecache_write_end(NULL, mapping, from, len, len, page, fsdata);
+        if (err < 0)
+            return err;
+    }
+    return 0;
+}
+
+/*
+ * The blocks of whole pages inside offset..end - 1 are freed, the bytes
+ * around them zeroed in the page cache. With zero set the range is then
+ * preallocated again, that is FALLOC_FL_ZERO_RANGE.
+ */
+static int msfs_punch(struct inode *inode, loff_t offset, loff_t end, int zero)
+{
+    struct msfs_inode_info *m_inode = msfs_i(inode);
+    loff_t first = round_up(offset, PAGE_CACHE_SIZE), last = round_down(end, PAGE_CACHE_SIZE);
+    int bits = inode->i_blkbits, err;
+
+    if (first < last) {
+        err = msfs_zero_bytes(inode, offset, first);
+        if (!err)
+            err = msfs_zero_bytes(inode, last, end);
+        if (err)
+            return err;
+        truncate_pagecache_range(inode, first, last - 1);
+        down_write(&m_inode->i_data_sem);
+        err = msfs_ext_punch(inode, first >> bits, last >> bits);
+        up_write(&m_inode->i_data_sem);
+    } else {
+        err = msfs_zero_bytes(inode, offset, end);
+    }
+    if (!err && zero)
+        err = msfs_prealloc(inode, offset >> bits, (end + (1 << bits) - 1) >> bits);
+    return err;
+}
+
+/*
+ * Preallocated blocks are unwritten extents, they read as zeros without
+ * any I/O and are converted once the first write into them is on disk.
+ */
+static long msfs_fallocate(struct file *file, int mode, loff_t offset, loff_t len)
+{
+    struct inode *inode = file_inode(file);
+    loff_t end = offset + len;
+    int bits = inode->i_blkbits;
+    long err;
 
-    for (i = 0 ; i < 10; i++)
+    if (!S_ISREG(inode->i_mode))
+        return -ENODEV;
+#ifdef FALLOC_FL_ZERO_RANGE
+    if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE))
+#else
+    if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE))
+#endif
+        return -EOPNOTSUPP;
+    if (!(mode & FALLOC_FL_PUNCH_HOLE) &&
+        !msfs_has_feature(inode->i_sb, MSFS_FEATURE_INCOMPAT_UNWRITTEN))
+        return -EOPNOTSUPP;
+
+    mutex_lock(&inode->i_mutex);
+    if (!(mode & FALLOC_FL_KEEP_SIZE)) {
+        err = inode_newsize_ok(inode, end);
+        if (err)
+            goto out;
+    }
+    //extents are needed here, the data gets its block first
+    if (msfs_inline(inode)) {
+        err = msfs_inline_spill(inode);
+        if (err)
+            goto out;
+    }
+    //delayed blocks get their real ones before the extents change under them
+    if (msfs_i(inode)->i_da_blocks) {
+        err = filemap_write_and_wait_range(inode->i_mapping, offset, end - 1);
+        if (err)
+            goto out;
+    }
+
+    if (mode & FALLOC_FL_PUNCH_HOLE)
+        err = msfs_punch(inode, offset, end, 0);
+#ifdef FALLOC_FL_ZERO_RANGE
+    else if (mode & FALLOC_FL_ZERO_RANGE)
+        err = msfs_punch(inode, offset, end, 1);
+#endif
+    else
+        err = msfs_prealloc(inode, offset >> bits, (end + (1 << bits) - 1) >> bits);
+    if (err)
+        goto out;
+
+    if (!(mode & FALLOC_FL_KEEP_SIZE) && end > i_size_read(inode))
+        i_size_write(inode, end);
+    inode->i_ctime = CURRENT_TIME_SEC;
+    if (mode & ~FALLOC_FL_KEEP_SIZE)
+        inode->i_mtime = inode->i_ctime;
+    mark_inode_dirty(inode);
+out:
+    mutex_unlock(&inode->i_mutex);
+    return err;
+}
+
+/*
+ * Find room for a name of namelen in a block: an unused record or the
+ * slack behind a live one, which is split off for the new entry.
+ */
+static struct msfs_dir_entry *msfs_free_slot(struct buffer_head *bh, int namelen)
+{
+    struct msfs_dir_entry *de = (struct msfs_dir_entry *)bh->b_data, *de1;
+    char *limit = bh->b_data + MSFS_BLOCK_SIZE;
+    int need = MSFS_DIR_REC_LEN(namelen), used;
+
+    for (; (char *)de < limit; de = msfs_next_entry(de))
     {
-        if (si->mfs_inode.i_zone[i])
+        if (!msfs_entry_ok(bh, de))
+            return NULL;
+        used = de->inode ? MSFS_DIR_REC_LEN(de->name_len) : 0;
+        if (de->rec_len - used >= need)
         {
-            bh_block = sb_bread(sb, si->mfs_inode.i_zone[i]);
-            de = (struct msfs_dir_entry *)bh_block->b_data;
-
-            for (j = 0; j < inumber; j++)
+            if (used)
             {
-                if (de->inode == 0)
-                {
-                    goto out;
-                }
-                if (!strcmp(name, de->name))
-                {
-                    brelse(bh_block);
-                    return -EEXIST;
-                }
-                de++;
+                de1 = (struct msfs_dir_entry *)((char *)de + used);
+                de1->rec_len = de->rec_len - used;
+                de->rec_len = used;
+                de = de1;
             }
+            return de;
         }
-        else
+    }
+    return NULL;
+}
+
+/*
+ * An indexed directory checks the name through the index and then tries the
+ * block that last lost an entry and the last block before growing, so it
+ * never has to scan the whole directory.
+ */
+static struct buffer_head *msfs_dx_slot(struct inode *dir, const char *name, int namelen,
+            struct msfs_dir_entry **res)
+{
+    struct msfs_inode_info *ms_info = msfs_i(dir);
+    unsigned long nblocks = dir->i_size / MSFS_BLOCK_SIZE;
+    struct msfs_dir_entry *de;
+    struct buffer_head *bh;
+
+    de = msfs_dx_find(dir, name, namelen, &bh);
+    if (IS_ERR(de))
+        return ERR_CAST(de);
+    if (de)
+    {
+        brelse(bh);
+        return ERR_PTR(-EEXIST);
+    }
+    *res = NULL;
+    if (ms_info->i_dx_hint)
+    {
+        bh = sb_bread(dir->i_sb, ms_info->i_dx_hint);
+        if (bh)
         {
-            free_block = msfs_new_block(dir->i_sb);
-            if (free_block)
-            {
-                si->mfs_inode.i_zone[i] = free_block;
-                bh_block = sb_bread(sb, si->mfs_inode.i_zone[i]);
-                de = (struct msfs_dir_entry *)bh_block->b_data;
+            *res = msfs_free_slot(bh, namelen);
+            if (*res)
+                return bh;
+            brelse(bh);
+        }
+        ms_info->i_dx_hint = 0;
+    }
+    bh = msfs_bread(dir, nblocks - 1, 0);
+    if (!bh)
+        return ERR_PTR(-EIO);
+    *res = msfs_free_slot(bh, namelen);
+    if (*res)
+        return bh;
+    brelse(bh);
+    return NULL;
+}
+
+int msfs_add_link(struct dentry *dentry, struct inode *inode)
+{
+    struct inode *dir = dentry->d_parent->d_inode;
+    const char * name = dentry->d_name.name;
+    int namelen = dentry->d_name.len;
+    struct msfs_dir_entry *de = NULL;
+    __u32 i = 0;
+    __u32 nblocks = dir->i_size / MSFS_BLOCK_SIZE;
+    struct buffer_head *bh_block = NULL;
+    sector_t block;
+    int grown = 0;
+
+    if (msfs_dx_indexed(dir))
+    {
+        bh_block = msfs_dx_slot(dir, name, namelen, &de);
+        if (!IS_ERR(bh_block))
+        {
+            if (bh_block)
                 goto out;
-            }
+            goto grow;
         }
+        if (PTR_ERR(bh_block) != -EIO || msfs_dx_indexed(dir))
+            return PTR_ERR(bh_block);
+        //the index was dropped, fall back to the scan
     }
-out:
-    if (de)
+
+    for (i = 0 ; i < nblocks; i++)
     {
-        de->inode = inode->i_ino;
-        memset(de->name, 0, MSFS_FILENAME_MAX_LEN);
-        memcpy(de->name, name, namelen);
-        i_size_write(dir, dir->i_size + sizeof(struct msfs_dir_entry));
-        mark_buffer_dirty(bh_block);
-        mark_inode_dirty(dir);
-        return 0;
+        bh_block = msfs_bread(dir, i, 0);
+        if (!bh_block)
+            return -EIO;
+        if (msfs_search_block(bh_block, name, namelen))
+        {
+            brelse(bh_block);
+            return -EEXIST;
+        }
+        de = msfs_free_slot(bh_block, namelen);
+        if (de)
+            goto out;
+        brelse(bh_block);
     }
-    return -ENODEV;
+
+grow:
+    //every block is full, grow the directory by one block
+    bh_block = msfs_bread(dir, nblocks, 1);
+    if (!bh_block)
+        return -ENOSPC;
+    de = (struct msfs_dir_entry *)bh_block->b_data;
+    de->rec_len = MSFS_BLOCK_SIZE;
+    i_size_write(dir, dir->i_size + MSFS_BLOCK_SIZE);
+    grown = 1;
+out:
+    de->inode = inode->i_ino;
+    de->name_len = namelen;
+    memcpy(de->name, name, namelen);
+    msfs_set_de_type(de, inode);
+    mark_buffer_dirty(bh_block);
+    block = bh_block->b_blocknr;
+    msfs_nc_add(dir, name, namelen, inode->i_ino, block, (char *)de - bh_block->b_data);
+    brelse(bh_block);
+    if (msfs_dx_indexed(dir))
+        msfs_dx_add(dir, name, namelen, block);
+    else if (grown || msfs_i(dir)->i_dx_retry)
+        msfs_dx_create(dir);
+    mark_inode_dirty(dir);
+    return 0;
 }
 
 static int add_nondir(struct dentry *dentry, struct inode *inode)
@@ -274,11 +1272,11 @@ static int msfs_unlink(struct inode * dir, struct dentry *dentry)
     if (!de)
         goto end_unlink;
 
-    err = msfs_delete_entry(de, bh);
+    err = msfs_delete_entry(dir, de, bh);
     if (err)
         goto end_unlink;
-    i_size_write(dentry->d_parent->d_inode, dentry->d_parent->d_inode->i_size - sizeof (struct msfs_dir_entry));
     mark_buffer_dirty(bh);
+    brelse(bh);
 
     inode->i_ctime = dir->i_ctime;
     if (S_ISLNK(inode->i_mode))
@@ -303,10 +1301,20 @@ static int msfs_symlink(struct inode * dir, struct dentry *dentry,
     if (!inode)
         goto out;
 
-    msfs_set_inode(inode, 0);
-    err = page_symlink(inode, symname, i);
-    if (err)
-        goto out_fail;
+    if (i <= msfs_inline_max(dir->i_sb)) {
+        //a short target lives in the inode, no block and no page cache
+        memset(msfs_i(inode)->mfs_inode.i_zone, 0, sizeof(msfs_i(inode)->mfs_inode.i_zone));
+        msfs_i(inode)->mfs_inode.i_flags |= MSFS_INLINE_DATA_FL;
+        memcpy(msfs_inline_data(inode), symname, i);
+        inode->i_size = i - 1;
+        msfs_set_inode(inode, 0);
+        mark_inode_dirty(inode);
+    } else {
+        msfs_set_inode(inode, 0);
+        err = page_symlink(inode, symname, i);
+        if (err)
+            goto out_fail;
+    }
 
     err = add_nondir(dentry, inode);
 out:
@@ -320,35 +1328,34 @@ out_fail:
 
 int msfs_make_empty(struct inode *inode, struct inode *dir)
 {
-    int err = 0, free_block_num = 0;
-    struct msfs_inode_info *ms_i_info = msfs_i(inode);
+    int err = 0;
     struct buffer_head *bh;
     struct msfs_dir_entry *de;
-    if (ms_i_info->mfs_inode.i_zone[0] == 0)
-    {
-       free_block_num = msfs_new_block(inode->i_sb);
-    }
 
-    if (!free_block_num)
+    bh = msfs_bread(inode, 0, 1);
+    if (!bh)
     {
-        return -ENOMEM;
+        return -ENOSPC;
     }
 
-    ms_i_info->mfs_inode.i_zone[0] = free_block_num;
-
-    bh = sb_bread(inode->i_sb, free_block_num);
-
     de = (struct msfs_dir_entry *)bh->b_data;
 
     de->inode = inode->i_ino;
-    strcpy(de->name, ".");
-    de++;
+    de->rec_len = MSFS_DIR_REC_LEN(1);
+    de->name_len = 1;
+    de->file_type = MSFS_FT_DIR;
+    memcpy(de->name, ".", 1);
+    de = msfs_next_entry(de);
     de->inode = dir->i_ino;
-    strcpy(de->name, "..");
+    de->rec_len = MSFS_BLOCK_SIZE - MSFS_DIR_REC_LEN(1);
+    de->name_len = 2;
+    de->file_type = MSFS_FT_DIR;
+    memcpy(de->name, "..", 2);
 
-    i_size_write(inode, sizeof (struct msfs_dir_entry)*2);
+    i_size_write(inode, MSFS_BLOCK_SIZE);
 
     mark_buffer_dirty(bh);
+    brelse(bh);
     mark_inode_dirty(inode);
 
     return err;
@@ -401,13 +1408,19 @@ static int msfs_rmdir(struct inode * dir, struct dentry *dentry)
 struct msfs_dir_entry * msfs_dotdot (struct inode *dir, struct buffer_head **bh)
 {
     struct msfs_dir_entry *de = NULL;
-    struct msfs_inode_info *ms_inode = msfs_i(dir);
     struct buffer_head *bh_res;
 
-    bh_res = sb_bread(dir->i_sb, ms_inode->mfs_inode.i_zone[0]);
+    bh_res = msfs_bread(dir, 0, 0);
+    if (!bh_res)
+        return NULL;
     de = (struct msfs_dir_entry *)bh_res->b_data;
+    if (!msfs_entry_ok(bh_res, de) || de->rec_len == MSFS_BLOCK_SIZE)
+    {
+        brelse(bh_res);
+        return NULL;
+    }
     *bh = bh_res;
-    return (de + 1);
+    return msfs_next_entry(de);
 }
 
 static int msfs_rename(struct inode * old_dir, struct dentry *old_dentry,
@@ -441,7 +1454,9 @@ static int msfs_rename(struct inode * old_dir, struct dentry *old_dentry,
         if (new_de)
         {
             new_de->inode = old_inode->i_ino;
-            strcpy(new_de->name, new_dentry->d_name.name);
+            msfs_set_de_type(new_de, old_inode);
+            msfs_nc_add(new_dir, new_de->name, new_de->name_len, old_inode->i_ino,
+                    bh_new->b_blocknr, (char *)new_de - bh_new->b_data);
             mark_buffer_dirty(bh_new);
             //drop_nlink(new_inode);
             //inode_dec_link_count(new_inode);
@@ -458,8 +1473,7 @@ static int msfs_rename(struct inode * old_dir, struct dentry *old_dentry,
             mark_buffer_dirty(bh_old);
         }
     }
-    msfs_delete_entry(old_de, bh);
-    i_size_write(old_dir, new_dir->i_size - sizeof (struct msfs_dir_entry));
+    msfs_delete_entry(old_dir, old_de, bh);
     new_dir->i_atime = CURRENT_TIME;
     mark_inode_dirty(old_dir);
     mark_inode_dirty(new_dir);
@@ -489,73 +1503,52 @@ const struct inode_operations msfs_dir_inode_operations = {
  *
 */
 
+#define MSFS_DIR_RA_BLOCKS 64
+
 static int msfs_readdir(struct file * filp, void * dirent, filldir_t filldir)
 {
-    unsigned long pos = filp->f_pos;
     struct inode *inode = file_inode(filp);
-    struct msfs_inode_info *msfs_inode_f = msfs_i(inode);
-    int i = 0, j = 0, first = 0, offset = 0, index = 0;
-
-    int per_de = MSFS_BLOCK_SIZE / sizeof(struct msfs_dir_entry);
-    int block = pos / MSFS_BLOCK_SIZE;
+    unsigned long nblocks = inode->i_size / MSFS_BLOCK_SIZE;
+    unsigned long i = filp->f_pos / MSFS_BLOCK_SIZE, first = i;
+    unsigned int offset = filp->f_pos % MSFS_BLOCK_SIZE, pos;
     struct msfs_dir_entry *de;
     struct buffer_head *bh;
     int over;
 
-    if (block > 10)
+    for(; i < nblocks; i++, offset = 0)
     {
-        return -ENODEV;
-    }
-
-    for(i = block; i < 10; i++)
-    {
-        if (msfs_inode_f->mfs_inode.i_zone[i] != 0)
+        if (i == first || !(i % MSFS_DIR_RA_BLOCKS))
+            msfs_dir_readahead(inode, i, MSFS_DIR_RA_BLOCKS);
+        bh = msfs_bread(inode, i, 0);
+        if (!bh)
         {
-            bh = sb_bread(inode->i_sb, msfs_inode_f->mfs_inode.i_zone[i]);
-            de = (struct msfs_dir_entry *)bh->b_data;
-            j = 0;
-            if (!first)
-            {
-                first = 1;
-                offset = pos - block * MSFS_BLOCK_SIZE;
-                index = offset / sizeof(struct msfs_dir_entry);
-                if (index >= per_de)
-                {
-                    continue;
-                }
-                else
-                {
-                    j = index;
-                }
-                de += j;
-            }
+            return -EIO;
+        }
+        de = (struct msfs_dir_entry *)bh->b_data;
 
-            for(; j < per_de; j++)
+        // walk from the block start, f_pos may point into a merged record
+        for(; (char *)de < bh->b_data + MSFS_BLOCK_SIZE; de = msfs_next_entry(de))
+        {
+            if (!msfs_entry_ok(bh, de))
+                break;
+            pos = (char *)de - bh->b_data;
+            if (pos < offset)
+                continue;
+            if (de->inode)
             {
-                if (!de->inode)
-                {
-                    // even if an null dir wo also must update filp->f_pos
-                    filp->f_pos += sizeof(struct msfs_dir_entry);
-                    de++;
-                    continue;
-                }
-
-                filp->f_pos += sizeof(struct msfs_dir_entry);
-                over = filldir(dirent, de->name, strnlen(de->name, MSFS_FILENAME_MAX_LEN), filp->f_pos, de->inode,
-                        DT_UNKNOWN);
+                over = filldir(dirent, de->name, de->name_len,
+                        (loff_t)i * MSFS_BLOCK_SIZE + pos, de->inode, msfs_dt_type(de));
                 if (over)
                 {
                     brelse(bh);
                     goto out;
                 }
-                de++;
             }
-            brelse(bh);
-        }
-        else
-        {
-            return -EIO;
+            // even if an null dir wo also must update filp->f_pos
+            filp->f_pos = (loff_t)i * MSFS_BLOCK_SIZE + pos + de->rec_len;
         }
+        brelse(bh);
+        filp->f_pos = (loff_t)(i + 1) * MSFS_BLOCK_SIZE;
     }
 out:
     return 0;
@@ -566,6 +1559,7 @@ const struct file_operations msfs_dir_operations = {
     .read		= generic_read_dir,
     .readdir	= msfs_readdir,
     .fsync		= generic_file_fsync,
+    .unlocked_ioctl	= msfs_ioctl,
 };
 
 
@@ -576,3 +1570,159 @@ const struct inode_operations msfs_symlink_inode_operations = {
     .getattr	= msfs_getattr,
 };
 
+//the NUL terminated target is in the inode already
+static void *msfs_follow_link(struct dentry *dentry, struct nameidata *nd)
+{
+    nd_set_link(nd, msfs_inline_data(dentry->d_inode));
+    return NULL;
+}
+
+const struct inode_operations msfs_fast_symlink_inode_operations = {
+    .readlink	= generic_readlink,
+    .follow_link	= msfs_follow_link,
+    .getattr	= msfs_getattr,
+};
+
+/*
+ * Where the next data (or hole) starts at or after offset. Preallocated
+ * extents read as zeros so they count as holes, dirty pages are written
+ * first so that all data has its extent.
+ */
+static loff_t msfs_seek_data_hole(struct inode *inode, loff_t offset, int whence)
+{
+    struct msfs_inode_info *ei = msfs_i(inode);
+    loff_t isize = i_size_read(inode);
+    sector_t block, end, phys;
+    unsigned int flags, len;
+    int n = 0, data;
+
+    if (offset < 0 || offset >= isize)
+        return -ENXIO;
+    if (msfs_inline(inode))
+        return whence == SEEK_DATA ? offset : isize;
+    if (mapping_tagged(inode->i_mapping, PAGECACHE_TAG_DIRTY)) {
+        n = filemap_write_and_wait(inode->i_mapping);
+        if (n)
+            return n;
+    }
+
+    block = offset >> inode->i_blkbits;
+    end = (isize + inode->i_sb->s_blocksize - 1) >> inode->i_blkbits;
+    down_read(&ei->i_data_sem);
+    for (; block < end; block += n) {
+        len = min_t(sector_t, end - block, INT_MAX);
+        n = msfs_ext_map(inode, block, len, &phys, &flags);
+        data = n > 0 && !(flags & MSFS_EXT_UNWRITTEN);
+        if (!n)
+            n = msfs_ext_hole(inode, block, len);
+        if (n <= 0) {
+            n = n ? n : -EIO;
+            break;
+        }
+        if (data == (whence == SEEK_DATA))
+            break;
+    }
+    up_read(&ei->i_data_sem);
+
+    if (n < 0)
+        return n;
+    if (block >= end)
+        return whence == SEEK_DATA ? -ENXIO : isize;
+    return max_t(loff_t, offset, (loff_t)block << inode->i_blkbits);
+}
+
+//SEEK_DATA and SEEK_HOLE skip the holes, everything else is the generic one
+static loff_t msfs_llseek(struct file *file, loff_t offset, int whence)
+{
+    struct inode *inode = file->f_mapping->host;
+
+    if (whence != SEEK_DATA && whence != SEEK_HOLE)
+        return generic_file_llseek(file, offset, whence);
+
+    mutex_lock(&inode->i_mutex);
+    offset = msfs_seek_data_hole(inode, offset, whence);
+    if (offset >= 0 && offset != file->f_pos) {
+        file->f_pos = offset;
+        file->f_version = 0;
+    }
+    mutex_unlock(&inode->i_mutex);
+    return offset;
+}
+
+/*
+ * Extents of a file for FS_IOC_FIEMAP. Delayed blocks are written out
+ * first so everything has its address, preallocated extents are reported
+ * unwritten. i_data_sem is not held across the copy to the user, whose
+ * buffer may be a mapping of this very file.
+ */
+static int msfs_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo,
+            u64 start, u64 len)
+{
+    struct msfs_inode_info *ei = msfs_i(inode);
+    int bits = inode->i_blkbits;
+    sector_t block, end, limit, phys;
+    u64 ex_logical = 0, ex_phys = 0, ex_len = 0; //the extent not reported yet
+    unsigned int flags, ex_flags = 0;
+    int n, hole, err;
+
+    err = fiemap_check_flags(fieinfo, FIEMAP_FLAG_SYNC);
+    if (err)
+        return err;
+    if ((fieinfo->fi_flags & FIEMAP_FLAG_SYNC) || ei->i_da_blocks ||
+        atomic_read(&ei->i_unwritten)) {
+        err = filemap_write_and_wait(inode->i_mapping);
+        if (err)
+            return err;
+    }
+    if (msfs_inline(inode)) {
+        if (start >= i_size_read(inode))
+            return 0;
+        err = fiemap_fill_next_extent(fieinfo, 0, 0, i_size_read(inode),
+                    FIEMAP_EXTENT_DATA_INLINE | FIEMAP_EXTENT_NOT_ALIGNED |
+                    FIEMAP_EXTENT_LAST);
+        return err < 0 ? err : 0;
+    }
+
+    //past the range only to learn whether the last extent is the last one
+    limit = (inode->i_sb->s_maxbytes + (1 << bits) - 1) >> bits;
+    block = start >> bits;
+    end = min_t(u64, (start + len + (1 << bits) - 1) >> bits, limit);
+    while (block < limit) {
+        down_read(&ei->i_data_sem);
+        n = msfs_ext_map(inode, block, min_t(sector_t, limit - block, INT_MAX),
+                         &phys, &flags);
+        hole = !n;
+        if (hole) {
+            n = msfs_ext_hole(inode, block, min_t(sector_t, limit - block, INT_MAX));
+            n = n ? n : -EIO;
+        }
+        up_read(&ei->i_data_sem);
+        if (n < 0) {
+            err = n;
+            break;
+        }
+        if (hole) {
+            block += n;
+            continue;
+        }
+        if (block >= end)
+            break;
+
+        if (ex_len) {
+            err = fiemap_fill_next_extent(fieinfo, ex_logical, ex_phys, ex_len, ex_flags);
+            if (err)
+                break;
+        }
+        ex_logical = (u64)block << bits;
+        ex_phys = (u64)phys << bits;
+        ex_len = (u64)n << bits;
+        ex_flags = (flags & MSFS_EXT_UNWRITTEN) ? FIEMAP_EXTENT_UNWRITTEN : 0;
+        block += n;
+    }
+    if (!err && ex_len) {
+        if (block >= limit)
+            ex_flags |= FIEMAP_EXTENT_LAST;
+        err = fiemap_fill_next_extent(fieinfo, ex_logical, ex_phys, ex_len, ex_flags);
+    }
+    return err < 0 ? err : 0;
+}
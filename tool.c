@@ -9,153 +9,291 @@
 #ifdef CONFIG_MSFS_TOOL
 char zone[1024*1024*2] = { 0 };
 #endif
-int setup_msfs_filesystem(char *p, int size)
+
+//mkfs makes INLINE_DATA inodes of the largest size
+#define INODES_PER_BLOCK (MSFS_BLOCK_SIZE / MSFS_INODE_SIZE_MAX)
+
+static void set_map_bit(char *map, int nr)
 {
+    map[nr >> 3] |= 1 << (nr & 7);
+}
 
-    int all_zones = size / MSFS_BLOCK_SIZE;
-    int inode_count = MSFS_BLOCK_SIZE;
-    int inode_map_blocks = inode_count / MSFS_BLOCK_SIZE;
-    int inode_blocks =  (inode_count * sizeof (struct msfs_inode)) / MSFS_BLOCK_SIZE;
-    int zone_map_blocks = all_zones / MSFS_BLOCK_SIZE;
+//append an entry of rec_len bytes at de and return the place for the next one
+static struct msfs_dir_entry *add_dir_entry(struct msfs_dir_entry *de, const char *name,
+                                            __u32 ino, int type, int rec_len)
+{
+    de->inode = ino;
+    de->rec_len = rec_len;
+    de->name_len = strlen(name);
+    de->file_type = type;
+    memcpy(de->name, name, de->name_len);
+    return (struct msfs_dir_entry *)((char *)de + rec_len);
+}
 
-    char *p_imap_block;
-    char *p_root_inode;
-    char *p_first_data_zone;
-    char *p_first_zone_block;
-    char *p_zone_map_block;
+//map logical block 0 of inode to start with a one extent tree
+static void setup_extent_root(struct msfs_inode *inode, __u32 start)
+{
+    struct msfs_extent_header *eh = (struct msfs_extent_header *)inode->i_zone;
+    struct msfs_extent *ex = (struct msfs_extent *)(eh + 1);
 
-    struct msfs_inode root_inode;
-    struct msfs_dir_entry *de;
-    struct msfs_dir_entry decpy;
-    struct msfs_inode *msfs_txt;
+    memset(inode->i_zone, 0, sizeof(inode->i_zone));
+    eh->eh_magic = MSFS_EXT_MAGIC;
+    eh->eh_max = MSFS_EXT_ROOT_MAX;
+    eh->eh_entries = 1;
+    ex->ee_block = 0;
+    ex->ee_start = start;
+    ex->ee_len = 1;
+}
 
-    int i = 0;
-    char *p_sp = (p + 1024);
-    struct msfs_super_block sp;
-    memset(p, 0, size);
+//inode ino of an inode table block
+static struct msfs_inode *inode_at(char *table, int ino)
+{
+    return (struct msfs_inode *)(table + ino * MSFS_INODE_SIZE_MAX);
+}
 
+/*
+ * Pick the group size, smaller groups on small devices so there are still
+ * a few of them to spread the allocations over.
+ */
+static void setup_groups(struct msfs_super_block *sp, int all_zones)
+{
+    int bpg = MSFS_BITS_PER_BLOCK, ipg, groups, gdt_blocks = 1;
+    int ipb = INODES_PER_BLOCK;
 
-    sp.s_nzones = all_zones;
-    sp.s_magic = MSFS_MAGIG;
-    sp.s_ninodes = inode_count;
-    sp.s_imap_blocks = inode_map_blocks;
-    sp.s_zmap_blocks = zone_map_blocks;
-    sp.s_firstdatazone = 2 + inode_map_blocks + zone_map_blocks + inode_blocks;
+    while (bpg > 256 && (all_zones - 2 - gdt_blocks) / bpg < 8)
+        bpg /= 2;
+    groups = (all_zones - 2 - gdt_blocks + bpg - 1) / bpg;
+    gdt_blocks = (groups + MSFS_DESC_PER_BLOCK - 1) / MSFS_DESC_PER_BLOCK;
+    groups = (all_zones - 2 - gdt_blocks + bpg - 1) / bpg;
 
+    ipg = (bpg / 4 + ipb - 1) / ipb * ipb;
 
-    memcpy(p_sp, &sp, sizeof(struct msfs_super_block)); //ok our superblock
+    //a short last group without room for data is not worth it
+    if ((all_zones - 2 - gdt_blocks) % bpg &&
+        (all_zones - 2 - gdt_blocks) % bpg < 2 + (ipg + ipb - 1) / ipb + 1)
+        groups--;
 
-    //create root inode
+    sp->s_first_data_block = 2 + gdt_blocks;
+    sp->s_blocks_per_group = bpg;
+    sp->s_inodes_per_group = ipg;
+    sp->s_inodes_count = groups * ipg;
+    if (sp->s_first_data_block + groups * bpg < all_zones)
+        sp->s_blocks_count = sp->s_first_data_block + groups * bpg;
+    else
+        sp->s_blocks_count = all_zones;
+}
 
-    root_inode.i_mode = 0040000;
-    root_inode.i_size = sizeof(struct msfs_dir_entry)*3;//".", "..", "msfs.txt"
+//mkfs builds one block at a time here, the device is only written through write_block
+static char block[MSFS_BLOCK_SIZE];
 
-    p_root_inode = p + (2 + inode_map_blocks + zone_map_blocks)*MSFS_BLOCK_SIZE + sizeof (struct msfs_inode)*MSFS_ROOT_INO;
-    for (i = 0; i < 10; i++)
-    {
-        root_inode.i_zone[i] = 0;
-    }
+/*
+ * Write a fresh filesystem to a device of nr_blocks blocks. Blocks that are not
+ * written must read back as zeros: the MBR, the inode tables past the root
+ * and msfs.txt and all the data blocks are left to that. msfs.txt is small
+ * enough to live inside its inode.
+ */
+int setup_msfs_filesystem(void *dev, unsigned long nr_blocks,
+                          int (*write_block)(void *dev, unsigned long nr, const char *data))
+{
+    int all_zones = nr_blocks;
+    int groups, inode_blocks, group_blocks, first, root_first;
 
-    root_inode.i_zone[0] = sp.s_firstdatazone;
+    struct msfs_dir_entry *de;
+    struct msfs_group_desc *gd;
+    struct msfs_inode *inode;
 
-    memcpy(p_root_inode, &root_inode, sizeof (struct msfs_inode));
+    int i = 0, g, err;
+    struct msfs_super_block sp;
+    memset(&sp, 0, sizeof(sp));
 
-    //root inode has used and zero inode alse used
-    p_imap_block = p + 2*MSFS_BLOCK_SIZE;
-    *p_imap_block = 1;
-    *(p_imap_block + 1) = 1;
 
-    // now we create a file in root dir msfs.txt
-    p_first_data_zone = p + (sp.s_firstdatazone)*MSFS_BLOCK_SIZE;
+    sp.s_magic = MSFS_MAGIG;
+    sp.s_feature_incompat = MSFS_FEATURE_INCOMPAT_EXTENTS | MSFS_FEATURE_INCOMPAT_BITMAP |
+        MSFS_FEATURE_INCOMPAT_GROUPS | MSFS_FEATURE_INCOMPAT_DIR_INDEX |
+        MSFS_FEATURE_INCOMPAT_DIRENT | MSFS_FEATURE_INCOMPAT_UNWRITTEN |
+        MSFS_FEATURE_INCOMPAT_INLINE_DATA;
+    sp.s_inode_size = MSFS_INODE_SIZE_MAX;
+    setup_groups(&sp, all_zones);
+    groups = (sp.s_blocks_count - sp.s_first_data_block + sp.s_blocks_per_group - 1) /
+        sp.s_blocks_per_group;
+    inode_blocks = (sp.s_inodes_per_group + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK;
 
-    de = (struct msfs_dir_entry *)p_first_data_zone;
-    memset(&decpy, 0, sizeof (struct msfs_dir_entry));
-    memcpy(de->name, ".", strlen("."));
-    de->inode = MSFS_ROOT_INO;
-    de+=1;
-    memcpy(de->name, "..", strlen(".."));
-    de->inode = MSFS_ROOT_INO;
+    //root dir takes the first data block of group 0
+    root_first = sp.s_first_data_block + 2 + inode_blocks;
 
-    de += 1;
-    memcpy(de->name, "msfs.txt", strlen("msfs.txt"));
-    de->inode = 2;
+    //every group: block bitmap, inode bitmap, inode table, data
+    for (g = 0; g < groups; g++) {
+        if (g % MSFS_DESC_PER_BLOCK == 0)
+            memset(block, 0, MSFS_BLOCK_SIZE);
+        gd = (struct msfs_group_desc *)block + g % MSFS_DESC_PER_BLOCK;
 
-    *(p_imap_block + 2) = 1;
+        first = sp.s_first_data_block + g * sp.s_blocks_per_group;
+        group_blocks = sp.s_blocks_count - first;
+        if (group_blocks > sp.s_blocks_per_group)
+            group_blocks = sp.s_blocks_per_group;
 
-    msfs_txt = (struct msfs_inode *)(p_root_inode + sizeof (struct msfs_inode));
+        gd->bg_block_bitmap = first;
+        gd->bg_inode_bitmap = first + 1;
+        gd->bg_inode_table = first + 2;
+        gd->bg_free_blocks_count = group_blocks - 2 - inode_blocks;
+        gd->bg_free_inodes_count = sp.s_inodes_per_group;
+        if (g == 0) {
+            gd->bg_free_blocks_count -= 1;
+            gd->bg_free_inodes_count -= 3;
+        }
+        sp.s_free_blocks_count += gd->bg_free_blocks_count;
+        sp.s_free_inodes_count += gd->bg_free_inodes_count;
 
-    msfs_txt->i_mode = 0100000;
+        if (g % MSFS_DESC_PER_BLOCK == MSFS_DESC_PER_BLOCK - 1 || g == groups - 1) {
+            err = write_block(dev, MSFS_GDT_BLOCK + g / MSFS_DESC_PER_BLOCK, block);
+            if (err)
+                return err;
+        }
+    }
 
-    for (i = 0; i < 10; i++)
-    {
-        msfs_txt->i_zone[i] = 0;
+    for (g = 0; g < groups; g++) {
+        first = sp.s_first_data_block + g * sp.s_blocks_per_group;
+        group_blocks = sp.s_blocks_count - first;
+        if (group_blocks > sp.s_blocks_per_group)
+            group_blocks = sp.s_blocks_per_group;
+
+        memset(block, 0, MSFS_BLOCK_SIZE);
+        for (i = 0; i < 2 + inode_blocks; i++)
+            set_map_bit(block, i);
+        //no object behind the padding bits of the maps
+        for (i = group_blocks; i < MSFS_BITS_PER_BLOCK; i++)
+            set_map_bit(block, i);
+        if (g == 0)
+            set_map_bit(block, root_first - first);
+        err = write_block(dev, first, block);
+        if (err)
+            return err;
+
+        memset(block, 0, MSFS_BLOCK_SIZE);
+        for (i = sp.s_inodes_per_group; i < MSFS_BITS_PER_BLOCK; i++)
+            set_map_bit(block, i);
+        //root inode has used and zero inode alse used
+        if (g == 0) {
+            set_map_bit(block, 0);
+            set_map_bit(block, MSFS_ROOT_INO);
+            set_map_bit(block, 2);
+        }
+        err = write_block(dev, first + 1, block);
+        if (err)
+            return err;
     }
 
-    msfs_txt->i_zone[0] = sp.s_firstdatazone + 1;
+    //create root inode and msfs.txt, both in the first inode table block
+    memset(block, 0, MSFS_BLOCK_SIZE);
+    inode = inode_at(block, MSFS_ROOT_INO);
+    inode->i_mode = 0040000;
+    inode->i_size = MSFS_BLOCK_SIZE;//".", "..", "msfs.txt" in one block
+    setup_extent_root(inode, root_first);
 
-    p_first_zone_block = p + (sp.s_firstdatazone + 1)*1024;
-    memcpy(p_first_zone_block, "hello msfs\n", strlen("hello msfs\n"));
+    inode = inode_at(block, 2);
+    inode->i_mode = 0100000;
+    inode->i_size = strlen("hello msfs\n");
+    inode->i_flags = MSFS_INLINE_DATA_FL;
+    memcpy(inode->i_zone, "hello msfs\n", inode->i_size);
 
-    msfs_txt->i_size = strlen("hello msfs\n");
+    err = write_block(dev, sp.s_first_data_block + 2, block);
+    if (err)
+        return err;
 
-    p_zone_map_block = p + (2 + inode_map_blocks)*MSFS_BLOCK_SIZE;
-    *p_zone_map_block = 1;
-    return 0;
+    // now we create a file in root dir msfs.txt
+    memset(block, 0, MSFS_BLOCK_SIZE);
+    de = (struct msfs_dir_entry *)block;
+    de = add_dir_entry(de, ".", MSFS_ROOT_INO, MSFS_FT_DIR, MSFS_DIR_REC_LEN(1));
+    de = add_dir_entry(de, "..", MSFS_ROOT_INO, MSFS_FT_DIR, MSFS_DIR_REC_LEN(2));
+    add_dir_entry(de, "msfs.txt", 2, MSFS_FT_REG_FILE,
+                  MSFS_BLOCK_SIZE - MSFS_DIR_REC_LEN(1) - MSFS_DIR_REC_LEN(2));
+    err = write_block(dev, root_first, block);
+    if (err)
+        return err;
+
+    memset(block, 0, MSFS_BLOCK_SIZE);
+    memcpy(block, &sp, sizeof(struct msfs_super_block)); //ok our superblock
+    return write_block(dev, 1, block);
 
 }
 
 #ifdef CONFIG_MSFS_TOOL
+static __u32 first_zone(struct msfs_inode *inode)
+{
+    struct msfs_extent_header *eh = (struct msfs_extent_header *)inode->i_zone;
+    struct msfs_extent *ex = (struct msfs_extent *)(eh + 1);
+
+    if (eh->eh_magic != MSFS_EXT_MAGIC || eh->eh_depth || !eh->eh_entries)
+        return 0;
+    return ex->ee_start;
+}
+
 void scan_msfs_filesystem(char *p, int size)
 {
     struct msfs_super_block *sp = (struct msfs_super_block *)(p + 1024);
+    struct msfs_group_desc *gd = (struct msfs_group_desc *)(p + MSFS_GDT_BLOCK*1024);
+    int groups = (sp->s_blocks_count - sp->s_first_data_block + sp->s_blocks_per_group - 1) /
+        sp->s_blocks_per_group;
     printf("-----:%d\n", sizeof (struct msfs_inode));
-    printf("msfs block info:%d %d %d %d %d %d\n",sp->s_magic,
-           sp->s_nzones,sp->s_ninodes, sp->s_imap_blocks, sp->s_zmap_blocks, sp->s_firstdatazone);
+    printf("msfs block info:%d %d %d %d %d %d free %d %d\n",sp->s_magic,
+           sp->s_blocks_count,sp->s_inodes_count, sp->s_first_data_block, sp->s_blocks_per_group,
+           sp->s_inodes_per_group, sp->s_free_blocks_count, sp->s_free_inodes_count);
 
-    char *p_root_inode = p + (2 + sp->s_imap_blocks + sp->s_zmap_blocks)*1024 + sizeof (struct msfs_inode)*MSFS_ROOT_INO;
-    struct msfs_inode *root_inode  = (struct msfs_inode *)p_root_inode;
-    printf("root inode :%d\n", root_inode->i_zone[0]);
-    struct msfs_inode *msfs_file = (p_root_inode + sizeof (struct msfs_inode));
-    printf("root inode :%d\n", msfs_file->i_zone[0]);
-
-    char *p_imap_block = p + 2*1024;
     int i = 0;
+    for (i = 0; i < groups; i++)
+    {
+        printf("group %d: %d %d %d free %d %d\n", i, gd[i].bg_block_bitmap, gd[i].bg_inode_bitmap,
+               gd[i].bg_inode_table, gd[i].bg_free_blocks_count, gd[i].bg_free_inodes_count);
+    }
+
+    struct msfs_inode *root_inode = inode_at(p + gd->bg_inode_table*1024, MSFS_ROOT_INO);
+    printf("root inode :%d\n", first_zone(root_inode));
+    struct msfs_inode *msfs_file = inode_at(p + gd->bg_inode_table*1024, 2);
+    printf("root inode :%d\n", first_zone(msfs_file));
+
+    char *p_imap_block = p + gd->bg_inode_bitmap*1024;
     for ( i =0 ;i < 1024; i++)
     {
         printf(" %d ", p_imap_block[i]);
     }
     printf("\n");
-    char *p_zmap_block = p + (2 + sp->s_imap_blocks)*1024;
-    for ( i =0 ;i < sp->s_zmap_blocks*1024; i++)
+    char *p_zmap_block = p + gd->bg_block_bitmap*1024;
+    for ( i =0 ;i < 1024; i++)
     {
         printf(" %d ", p_zmap_block[i]);
     }
     //ls root dir
     printf("\n");
-    char *p_first_data_zone = p + sp->s_firstdatazone*1024;
-    int j = 10224 / (sizeof (struct msfs_dir_entry));
-    struct msfs_dir_entry *de1 = (struct msfs_dir_entry *)p_first_data_zone;
-    for (i = 0; i < j; i++)
+    char *p_first_data_zone = p + first_zone(root_inode)*1024;
+    struct msfs_dir_entry *de;
+    for (i = 0; i < 1024 && ((struct msfs_dir_entry *)(p_first_data_zone + i))->rec_len; i += de->rec_len)
     {
-        struct msfs_dir_entry *de = de1 + i;
+        de = (struct msfs_dir_entry *)(p_first_data_zone + i);
         if (de->inode)
         {
-            printf("%s %d %d\n", de->name, de->inode, i);
+            printf("%.*s %d %d %d\n", de->name_len, de->name, de->inode, de->file_type, i);
             if (de->inode == 2)
             {
-                int m = de->inode / (1024/sizeof (struct msfs_inode));
-                int k = de->inode % (1024/sizeof (struct msfs_inode));
-                struct msfs_inode *file_node = ( struct msfs_inode *)((p_root_inode + m*1024) + (k-1)*sizeof(struct msfs_inode));
-                printf("%d %s\n",file_node->i_zone[0], (p + file_node->i_zone[0]*1024));
+                struct msfs_inode *file_node = inode_at(p + gd->bg_inode_table*1024, de->inode);
+                if (file_node->i_flags & MSFS_INLINE_DATA_FL)
+                    printf("inline %.*s\n", file_node->i_size, (char *)file_node->i_zone);
+                else
+                    printf("%d %s\n",first_zone(file_node), (p + first_zone(file_node)*1024));
             }
         }
     }
     //printf("\n");
 }
 
+static int write_zone(void *dev, unsigned long nr, const char *data)
+{
+    memcpy((char *)dev + nr*MSFS_BLOCK_SIZE, data, MSFS_BLOCK_SIZE);
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
-    setup_msfs_filesystem(zone, 1024*1024*2);
+    setup_msfs_filesystem(zone, sizeof(zone) / MSFS_BLOCK_SIZE, write_zone);
     scan_msfs_filesystem(zone, 1024*1024*2);
     return 0;
 }